@@ -1,6 +1,12 @@
 #include "background_remover.h"
 
+#include "bit_mask.h"
+#include "compositor.h"
+#include "event_log.h"
 #include "glog/logging.h"
+#include "metrics.h"
+#include "parallel.h"
+#include "trace.h"
 
 #ifdef WITH_GL
 #include "tensorflow/lite/delegates/gpu/delegate.h"
@@ -11,6 +17,7 @@
 #include <cstdio>
 #include <execution>
 #include <numeric>
+#include <sstream>
 #include <vector>
 
 const char *deeplabv3_label_names[] = {
@@ -23,6 +30,19 @@ constexpr int deeplabv3_label_count =
     sizeof(deeplabv3_label_names) / sizeof(deeplabv3_label_names[0]);
 typedef float DeeplabV3Labels[deeplabv3_label_count];
 
+// https://github.com/tensorflow/tfjs-models/tree/master/body-pix#body-part-ids
+const char *bodypix_part_names[] = {
+    "left_face", "right_face", "left_upper_arm_front", "left_upper_arm_back",
+    "right_upper_arm_front", "right_upper_arm_back", "left_lower_arm_front", "left_lower_arm_back",
+    "right_lower_arm_front", "right_lower_arm_back", "left_hand", "right_hand", "torso_front",
+    "torso_back", "left_upper_leg_front", "left_upper_leg_back", "right_upper_leg_front",
+    "right_upper_leg_back", "left_lower_leg_front", "left_lower_leg_back", "right_lower_leg_front",
+    "right_lower_leg_back", "left_foot", "right_foot",
+};
+
+constexpr int bodypix_part_count = sizeof(bodypix_part_names) / sizeof(bodypix_part_names[0]);
+typedef float BodypixParts[bodypix_part_count];
+
 static std::string tensor_shape(const TfLiteTensor *t) {
     std::stringstream ret;
     ret << "[";
@@ -34,6 +54,22 @@ static std::string tensor_shape(const TfLiteTensor *t) {
     return ret.str();
 }
 
+// Returns a mask with bit i set for every names[i] in the comma-separated list.
+template <int N>
+static uint32_t parseNameList(const std::string &list, const char *(&names)[N]) {
+    static_assert(N <= 32, "names don't fit into the mask");
+    uint32_t ret = 0;
+
+    std::stringstream ss(list);
+    for (std::string name; std::getline(ss, name, ',');) {
+        auto i = std::find(names, names + N, name);
+        CHECK(i != names + N) << "Unknown name " << name;
+        ret |= 1u << (i - names);
+    }
+
+    return ret;
+}
+
 BackgroundRemover::ModelType BackgroundRemover::parseModelType(const std::string &model_type) {
     if (model_type == "deeplabv3")
         return BackgroundRemover::ModelType::DeeplabV3;
@@ -45,20 +81,115 @@ BackgroundRemover::ModelType BackgroundRemover::parseModelType(const std::string
         return BackgroundRemover::ModelType::Undefined;
 }
 
-BackgroundRemover::BackgroundRemover(const std::string &model_filename,
-                                     const std::string &model_type, int num_threads)
-    : model_type_(parseModelType(model_type)) {
-    static_assert(sizeof(float) == 4, "floats must be 32 bits");
+void BackgroundRemover::findOutputs(const TfLiteInterpreter *interpreter, ModelType model_type,
+                                    const TfLiteTensor *&output,
+                                    const TfLiteTensor *&part_heatmaps) {
+    output = part_heatmaps = nullptr;
+    const int count = TfLiteInterpreterGetOutputTensorCount(interpreter);
+    if (model_type == ModelType::DeeplabV3) {
+        if (count > 0) output = TfLiteInterpreterGetOutputTensor(interpreter, 0);
+        return;
+    }
+    // Full bodypix models have more outputs (heatmaps, offsets, ...) in no particular order,
+    // tell them apart by their number of channels.
+    for (int i = 0; i < count; i++) {
+        const TfLiteTensor *t = TfLiteInterpreterGetOutputTensor(interpreter, i);
+        if (TfLiteTensorNumDims(t) != 4) continue;
+        int channels = TfLiteTensorDim(t, 3);
+        if (channels == 1 && !output)
+            output = t;
+        else if (channels == bodypix_part_count && !part_heatmaps)
+            part_heatmaps = t;
+    }
+}
 
-    CHECK(model_type_ != ModelType::Undefined) << "Invalid model type " << model_type;
+// Why the tensors don't fit model_type, or an empty string.
+std::string BackgroundRemover::checkTensors(ModelType model_type, const TfLiteTensor *input,
+                                            const TfLiteTensor *output,
+                                            const TfLiteTensor *part_heatmaps) {
+    if (!input) return "model has no input tensor";
+    if (TfLiteTensorType(input) != kTfLiteFloat32) return "input tensor must be float32";
+    if (TfLiteTensorNumDims(input) != 4) return "input tensor must have 4 dimensions";
+    if (TfLiteTensorDim(input, 0) != 1) return "input tensor batch size must be 1";
+    if (TfLiteTensorDim(input, 3) != 3) return "input tensor must have 3 channels";
+
+    if (!output)
+        return model_type == ModelType::DeeplabV3
+                   ? "model has no output tensor"
+                   : "Can't find the bodypix segmentation output tensor";
+    if (TfLiteTensorType(output) != kTfLiteFloat32) return "output tensor must be float32";
+    if (TfLiteTensorNumDims(output) != 4) return "output tensor must have 4 dimensions";
+    const int width = TfLiteTensorDim(input, 1), height = TfLiteTensorDim(input, 2);
+    const int outw = TfLiteTensorDim(output, 1), outh = TfLiteTensorDim(output, 2);
+    if (outw <= 0 || width % outw)
+        return "output tensor width is not a multiple of input tensor width";
+    if (outh <= 0 || height % outh)
+        return "output tensor height is not a multiple of input tensor height";
+    const int stride = width / outw;
+    if (height / outh != stride) return "vertical stride doesn't match horizontal stride";
+
+    const int channels = TfLiteTensorDim(output, 3);
+    switch (model_type) {
+        case ModelType::DeeplabV3:
+            if (stride != 1) return "deeplabv3 output stride must be 1";
+            if (channels != deeplabv3_label_count)
+                return "deeplabv3 output must have " + std::to_string(deeplabv3_label_count) +
+                       " channels";
+            break;
+        case ModelType::BodypixResnet:
+            if (stride != 16 && stride != 32) return "bodypix_resnet stride must be 16 or 32";
+            break;
+        case ModelType::BodypixMobilenet:
+            if (stride != 8 && stride != 16) return "bodypix_mobilenet stride must be 8 or 16";
+            break;
+        default:
+            return "Invalid model type";
+    }
 
-    model_ = CHECK_NOTNULL(TfLiteModelCreateFromFile(model_filename.c_str()));
+    if (part_heatmaps) {
+        if (TfLiteTensorType(part_heatmaps) != kTfLiteFloat32)
+            return "part heatmaps tensor must be float32";
+        if (TfLiteTensorDim(part_heatmaps, 1) != outw || TfLiteTensorDim(part_heatmaps, 2) != outh)
+            return "part heatmaps tensor size doesn't match the output tensor";
+    }
+    return "";
+}
 
-    options_ = CHECK_NOTNULL(TfLiteInterpreterOptionsCreate());
+std::string BackgroundRemover::checkModel(const std::string &model_filename,
+                                          const std::string &model_type, const Options &options) {
+    const ModelType type = parseModelType(model_type);
+    if (type == ModelType::Undefined) return "Invalid model type " + model_type;
+    TfLiteModel *model = TfLiteModelCreateFromFile(model_filename.c_str());
+    if (!model) return "Can't read a tflite model from " + model_filename;
+
+    std::string error;
+    TfLiteInterpreter *interpreter = TfLiteInterpreterCreate(model, nullptr);
+    if (!interpreter || TfLiteInterpreterAllocateTensors(interpreter) != kTfLiteOk) {
+        error = "Can't create an interpreter for " + model_filename;
+    } else {
+        const TfLiteTensor *output, *part_heatmaps;
+        findOutputs(interpreter, type, output, part_heatmaps);
+        const TfLiteTensor *input = TfLiteInterpreterGetInputTensorCount(interpreter) > 0
+                                        ? TfLiteInterpreterGetInputTensor(interpreter, 0)
+                                        : nullptr;
+        error = checkTensors(type, input, output, part_heatmaps);
+        if (!error.empty())
+            error = model_filename + " doesn't fit " + model_type + ": " + error;
+        else if (!options.excluded_parts.empty() && !part_heatmaps)
+            LOG(WARNING) << model_filename << " has no part heatmaps, excluded_parts are ignored";
+    }
+    if (interpreter) TfLiteInterpreterDelete(interpreter);
+    TfLiteModelDelete(model);
+    return error;
+}
 
-    TfLiteInterpreterOptionsSetNumThreads(options_, num_threads);
+BackgroundRemover::Interpreter BackgroundRemover::makeInterpreter(int num_threads) {
+    Interpreter ret;
+    ret.options = CHECK_NOTNULL(TfLiteInterpreterOptionsCreate());
+
+    TfLiteInterpreterOptionsSetNumThreads(ret.options, num_threads);
     TfLiteInterpreterOptionsSetErrorReporter(
-        options_,
+        ret.options,
         [](void *unused, const char *fmt, va_list args) {
             std::vector<char> buf(vsnprintf(nullptr, 0, fmt, args) + 1);
             std::vsnprintf(buf.data(), buf.size(), fmt, args);
@@ -66,49 +197,118 @@ BackgroundRemover::BackgroundRemover(const std::string &model_filename,
         },
         nullptr);
 #ifdef WITH_GL
+    // Delegates can't be shared between interpreters.
     auto delegate_opts = TfLiteGpuDelegateOptionsV2Default();
     delegate_opts.inference_preference = TFLITE_GPU_INFERENCE_PREFERENCE_SUSTAINED_SPEED;
     delegate_opts.inference_priority1 = TFLITE_GPU_INFERENCE_PRIORITY_MIN_LATENCY;
-    gpu_delegate_ = CHECK_NOTNULL(TfLiteGpuDelegateV2Create(&delegate_opts));
-    TfLiteInterpreterOptionsAddDelegate(options_, gpu_delegate_);
+    ret.gpu_delegate = CHECK_NOTNULL(TfLiteGpuDelegateV2Create(&delegate_opts));
+    TfLiteInterpreterOptionsAddDelegate(ret.options, ret.gpu_delegate);
 #endif
 
-    interpreter_ = CHECK_NOTNULL(TfLiteInterpreterCreate(model_, options_));
-    TfLiteInterpreterAllocateTensors(interpreter_);
-
-    input_ = CHECK_NOTNULL(TfLiteInterpreterGetInputTensor(interpreter_, 0));
-    LOG(INFO) << "Input tensor: " << tensor_shape(input_);
-    CHECK_EQ(TfLiteTensorType(input_), kTfLiteFloat32) << "input tensor must be float32";
-    CHECK_EQ(TfLiteTensorNumDims(input_), 4) << "input tensor must have 4 dimensions";
-    CHECK_EQ(TfLiteTensorDim(input_, 0), 1) << "input tensor batch size must be 1";
-    width_ = TfLiteTensorDim(input_, 1);
-    height_ = TfLiteTensorDim(input_, 2);
-    CHECK_EQ(TfLiteTensorDim(input_, 3), 3) << "input tensor must have 3 channels";
-
-    output_ = CHECK_NOTNULL(TfLiteInterpreterGetOutputTensor(interpreter_, 0));
-    LOG(INFO) << "Output tensor: " << tensor_shape(output_);
-    CHECK_EQ(TfLiteTensorType(output_), kTfLiteFloat32) << "output tensor must be float32";
-    CHECK_EQ(TfLiteTensorNumDims(output_), 4) << "output tensor must have 4 dimensions";
-    int outw = TfLiteTensorDim(output_, 1);
-    CHECK_EQ(width_ % outw, 0) << "output tensor width is not a multiple of input tensor width";
-    stride_ = width_ / outw;
-    int outh = TfLiteTensorDim(output_, 2);
-    CHECK_EQ(height_ % outh, 0) << "output tensor height is not a multiple of input tensor height";
-    CHECK_EQ(height_ / outh, stride_) << "vertical stride doesn't match horizontal stride";
+    ret.interpreter = CHECK_NOTNULL(TfLiteInterpreterCreate(model_, ret.options));
+    TfLiteInterpreterAllocateTensors(ret.interpreter);
 
-    if (model_type_ == ModelType::DeeplabV3) {
-        CHECK_EQ(stride_, 1);
-        CHECK_EQ(TfLiteTensorDim(output_, 3), deeplabv3_label_count);
-    } else if (model_type_ == ModelType::BodypixResnet) {
-        CHECK(stride_ == 16 || stride_ == 32);
-        CHECK_EQ(TfLiteTensorDim(output_, 3), 1);
-    } else if (model_type_ == ModelType::BodypixMobilenet) {
-        CHECK(stride_ == 8 || stride_ == 16);
-        CHECK_EQ(TfLiteTensorDim(output_, 3), 1);
+    ret.input = CHECK_NOTNULL(TfLiteInterpreterGetInputTensor(ret.interpreter, 0));
+    findOutputs(ret.interpreter, model_type_, ret.output, ret.part_heatmaps);
+    return ret;
+}
+
+void BackgroundRemover::warmup(Interpreter *interpreter, int runs) {
+    // The first invocations pay for lazy allocations, delegate (shader) compilation and cold
+    // caches. Get them out of the way before the first real frame.
+    std::vector<char> zeros(TfLiteTensorByteSize(interpreter->input));
+    for (int i = 0; i < runs; i++) {
+        TfLiteTensorCopyFromBuffer(interpreter->input, zeros.data(), zeros.size());
+        TfLiteInterpreterInvoke(interpreter->interpreter);
+    }
+}
+
+void BackgroundRemover::runWorker(Interpreter *interpreter, int num_threads, int num_warmup_runs,
+                                  std::promise<void> ready) {
+    setThreadName("infer-" + std::to_string(interpreter - interpreters_.data()));
+    *interpreter = makeInterpreter(num_threads);
+    warmup(interpreter, num_warmup_runs);
+    ready.set_value();
+
+    while (1) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(jobs_mutex_);
+            jobs_cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty()) break;
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        job.mask.set_value(infer(interpreter, job.frame));
     }
 
+    TfLiteInterpreterDelete(interpreter->interpreter);
+#ifdef WITH_GL
+    TfLiteGpuDelegateV2Delete(interpreter->gpu_delegate);
+#endif
+    TfLiteInterpreterOptionsDelete(interpreter->options);
+}
+
+BackgroundRemover::BackgroundRemover(const std::string &model_filename,
+                                     const std::string &model_type, const Options &options)
+    : model_type_(parseModelType(model_type)),
+      foreground_classes_(parseNameList(options.foreground_classes, deeplabv3_label_names)),
+      excluded_parts_(parseNameList(options.excluded_parts, bodypix_part_names)),
+      morph_radius_(options.morph_radius),
+      min_component_size_(options.min_component_size),
+      temporal_alpha_(options.temporal_alpha),
+      hysteresis_(options.hysteresis) {
+    static_assert(sizeof(float) == 4, "floats must be 32 bits");
+
+    CHECK(model_type_ != ModelType::Undefined) << "Invalid model type " << model_type;
+    int num_interpreters = options.num_interpreters;
+    CHECK_GE(num_interpreters, 1);
+    CHECK(temporal_alpha_ > 0 && temporal_alpha_ <= 1) << "temporal_alpha must be in (0, 1]";
+    CHECK(hysteresis_ >= 0 && hysteresis_ < .5) << "hysteresis must be in [0, .5)";
+
+    if (options.refine_radius > 0)
+        guided_filter_ = std::make_unique<GuidedFilter>(options.refine_radius, options.refine_eps);
+    if (options.light_wrap > 0 || options.color_match > 0)
+        edge_blender_ = std::make_unique<EdgeBlender>(options.blend_radius, options.light_wrap,
+                                                      options.color_match);
+
+    auto start = std::chrono::steady_clock::now();
+    model_ = CHECK_NOTNULL(TfLiteModelCreateFromFile(model_filename.c_str()));
+
+    // Interpreters are created and warmed up in parallel.
+    int threads_per_interpreter = std::max(1, options.num_threads / num_interpreters);
+    interpreters_.resize(num_interpreters);
+    std::vector<std::future<void>> ready;
+    for (auto &i : interpreters_) {
+        std::promise<void> p;
+        ready.push_back(p.get_future());
+        workers_.emplace_back(&BackgroundRemover::runWorker, this, &i, threads_per_interpreter,
+                              options.num_warmup_runs, std::move(p));
+    }
+    for (auto &r : ready) r.wait();
+    std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - start;
+    Metrics::get().setGauge("bgr_model_load_seconds", load_time.count());
+
+    // All interpreters run the same model, so checking the first one is enough.
+    const Interpreter &first = interpreters_[0];
+    const std::string error =
+        checkTensors(model_type_, first.input, first.output, first.part_heatmaps);
+    CHECK(error.empty()) << error;
+    LOG(INFO) << "Input tensor: " << tensor_shape(first.input);
+    LOG(INFO) << "Output tensor: " << tensor_shape(first.output);
+    if (first.part_heatmaps)
+        LOG(INFO) << "Part heatmaps tensor: " << tensor_shape(first.part_heatmaps);
+    width_ = TfLiteTensorDim(first.input, 1);
+    height_ = TfLiteTensorDim(first.input, 2);
+    stride_ = width_ / TfLiteTensorDim(first.output, 1);
+
+    // checkModel() warned about it. The workers don't read it before the first job.
+    if (!first.part_heatmaps) excluded_parts_ = 0;
+
     LOG(INFO) << "Initialized tflite with " << width_ << "x" << height_
-              << "px input and stride=" << stride_ << " for model " << model_filename;
+              << "px input and stride=" << stride_ << " for model " << model_filename << " ("
+              << num_interpreters << " interpreters with " << threads_per_interpreter
+              << " threads each, loaded and warmed up in " << load_time.count() << "s)";
 }
 
 static float minVec3f(const cv::Vec3f &v) { return std::min({v[0], v[1], v[2]}); }
@@ -149,79 +349,176 @@ cv::Mat BackgroundRemover::makeInputTensor(const cv::Mat &img) {
     return ret;
 }
 
-cv::Mat BackgroundRemover::getMaskFromOutput() {
-    constexpr int person_label = 15;  // XXX
-    constexpr float threshold = .5;   // XXX
+BitMask BackgroundRemover::getMaskFromOutput(const Interpreter *interpreter) {
+    constexpr float threshold = .5;  // XXX
 
     int maskw = width_ / stride_;
     int maskh = height_ / stride_;
 
-    cv::Mat ret = cv::Mat::zeros(cv::Size(maskw, maskh), CV_8U);
+    BitMask ret(maskw, maskh);
 
-    size_t size = TfLiteTensorByteSize(output_);
-    void *data = TfLiteTensorData(output_);
+    // Every row is packed into its own words, so rows can be done in parallel.
+    auto pack = [&](auto isBackground) {
+        parallelRows(maskh, [&](int begin, int end) {
+            for (int y = begin; y < end; y++) {
+                uint64_t *r = ret.row(y);
+                for (int x = 0; x < maskw; x++)
+                    r[x / 64] |= (uint64_t)isBackground(y * maskw + x) << (x % 64);
+            }
+        });
+    };
+
+    size_t size = TfLiteTensorByteSize(interpreter->output);
+    void *data = TfLiteTensorData(interpreter->output);
 
     if (model_type_ == ModelType::DeeplabV3) {
         CHECK_EQ(size, maskw * maskh * sizeof(DeeplabV3Labels));
-        DeeplabV3Labels *labels = (DeeplabV3Labels *)data;
-        std::for_each(std::execution::par_unseq, labels, labels + maskw * maskh,
-                      [&](DeeplabV3Labels l) {
-                          float *max = std::max_element(l, l + deeplabv3_label_count);
-                          int label = max - l;
-                          if (label != person_label) {
-                              int pixel = (DeeplabV3Labels *)l - labels;
-                              ret.at<unsigned char>(cv::Point(pixel % maskw, pixel / maskw)) = 1;
-                          }
-                      });
+        const DeeplabV3Labels *labels = (const DeeplabV3Labels *)data;
+        pack([&](int pixel) {
+            const float *l = labels[pixel];
+            int label = std::max_element(l, l + deeplabv3_label_count) - l;
+            return !(foreground_classes_ & (1u << label));
+        });
     } else {
         CHECK_EQ(size, maskw * maskh * sizeof(float));
-        float *prob = (float *)data;
-        std::for_each(std::execution::par_unseq, prob, prob + maskw * maskh, [&](float &p) {
-            if (p < threshold) {
-                int pixel = &p - prob;
-                ret.at<unsigned char>(cv::Point(pixel % maskw, pixel / maskw)) = 1;
-            }
+        const float *prob = (const float *)data;
+        const BodypixParts *parts = nullptr;
+        if (excluded_parts_) {
+            CHECK_EQ(TfLiteTensorByteSize(interpreter->part_heatmaps),
+                     maskw * maskh * sizeof(BodypixParts));
+            parts = (const BodypixParts *)TfLiteTensorData(interpreter->part_heatmaps);
+        }
+        // Both outputs are consumed in the same pass; the part heatmaps are only looked at for
+        // pixels that would be foreground otherwise.
+        pack([&](int pixel) {
+            if (prob[pixel] < threshold) return true;
+            if (!parts) return false;
+            const float *part = parts[pixel];
+            int id = std::max_element(part, part + bodypix_part_count) - part;
+            return (excluded_parts_ & (1u << id)) != 0;
         });
     }
 
+    if (morph_radius_ > 0) ret = ret.open(morph_radius_).close(morph_radius_);
+    if (min_component_size_ > 0) ret.removeSmallComponents(min_component_size_);
+
     return ret;
 }
 
-void BackgroundRemover::maskBackground(cv::Mat &frame /* rgb */,
-                                       const cv::Mat &maskImage /* rgb */) {
-    CHECK_EQ(frame.size, maskImage.size);
-    cv::Mat small;
-    cv::resize(frame, small, cv::Size(width_, height_), interpolation_method);
+BitMask BackgroundRemover::infer(Interpreter *interpreter, const cv::Mat &frame /* rgb */) {
+    {
+        TraceSpan span("preprocess");
+        cv::Mat small;
+        cv::resize(frame, small, cv::Size(width_, height_), interpolation_method);
 
-    cv::Mat input_float = makeInputTensor(small);
-    CHECK_EQ(input_float.elemSize(), sizeof(float) * 3 /* channels */);
+        cv::Mat input_float = makeInputTensor(small);
+        CHECK_EQ(input_float.elemSize(), sizeof(float) * 3 /* channels */);
 
-    TfLiteTensorCopyFromBuffer(input_, (const void *)input_float.ptr<float>(),
-                               width_ * height_ * sizeof(float) * 3);
+        TfLiteTensorCopyFromBuffer(interpreter->input, (const void *)input_float.ptr<float>(),
+                                   width_ * height_ * sizeof(float) * 3);
+    }
 
-    auto start = std::chrono::steady_clock::now();
-    TfLiteInterpreterInvoke(interpreter_);
-    auto end = std::chrono::steady_clock::now();
-    auto diffMs = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    LOG(INFO) << "Inference time: " << diffMs << "ms";
+    {
+        TraceSpan span("invoke");
+        auto start = std::chrono::steady_clock::now();
+        TfLiteInterpreterInvoke(interpreter->interpreter);
+        auto end = std::chrono::steady_clock::now();
+        EventLog::get().record("inference_ms",
+                               std::chrono::duration<double, std::milli>(end - start).count());
+    }
 
-    cv::Mat mask = getMaskFromOutput();
-    cv::resize(mask, mask, cv::Size(frame.cols, frame.rows), interpolation_method);
+    TraceSpan span("postprocess");
+    return getMaskFromOutput(interpreter);
+}
 
-    // XXX: Fix this.
-    for (int x = 0; x < frame.cols; x++)
-        for (int y = 0; y < frame.rows; y++)
-            if (mask.at<unsigned char>(cv::Point(x, y)))
-                frame.at<cv::Vec3b>(cv::Point(x, y)) = maskImage.at<cv::Vec3b>(cv::Point(x, y));
-    // frame.setTo(maskImage, mask);
-    // cv::bitwise_and(frame, mask, frame);
+std::future<BitMask> BackgroundRemover::getMask(const cv::Mat &frame /* rgb */) {
+    Job job{frame};
+    auto ret = job.mask.get_future();
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex_);
+        jobs_.push_back(std::move(job));
+    }
+    jobs_cv_.notify_one();
+    return ret;
+}
+
+// Masks flicker because every frame is thresholded on its own. Averaging them over time and
+// only flipping a pixel once the average is clearly past .5 keeps the edges steady. The model
+// outputs aren't calibrated probabilities (DeepLabV3 is an argmax), so this averages the
+// per-frame decisions.
+BitMask BackgroundRemover::smoothMask(const BitMask &mask) {
+    if (temporal_alpha_ >= 1) return mask;
+
+    if (!mask_state_.sameSize(mask)) {
+        mask.toMat().convertTo(mask_average_, CV_32F);
+        mask_state_ = mask;
+        return mask;
+    }
+
+    const float lo = .5f - hysteresis_, hi = .5f + hysteresis_;
+    parallelRows(mask.height(), [&](int begin, int end) {
+        std::vector<unsigned char> m(mask.width());
+        for (int y = begin; y < end; y++) {
+            mask.expandRow(y, m.data());
+            float *avg = mask_average_.ptr<float>(y);
+            for (int x = 0; x < mask.width(); x++) {
+                avg[x] += temporal_alpha_ * (m[x] - avg[x]);
+                if (avg[x] > hi)
+                    mask_state_.set(x, y, true);
+                else if (avg[x] < lo)
+                    mask_state_.set(x, y, false);
+            }
+        }
+    });
+
+    return mask_state_;
+}
+
+BitMask BackgroundRemover::nextMask(const BitMask &rawMask) {
+    BitMask mask = smoothMask(rawMask);
+
+    if (prev_mask_.sameSize(mask))
+        Metrics::get().setGauge("bgr_mask_changed_fraction",
+                                (double)mask.countDifferent(prev_mask_) /
+                                    (mask.width() * mask.height()));
+    prev_mask_ = mask;
+    return mask;
+}
+
+void BackgroundRemover::applyMask(cv::Mat &frame /* rgb */, const BitMask &rawMask,
+                                  const Background &background /* rgb */) {
+    TraceSpan span("composite");
+    BitMask mask = nextMask(rawMask);
+
+    if (guided_filter_)
+        compositeAlpha(frame, background, guided_filter_->upsample(frame, mask.toMat()));
+    else
+        compositeMask(frame, background, mask);
+    if (edge_blender_) edge_blender_->apply(frame, background, mask);
+}
+
+void BackgroundRemover::matteMask(const cv::Mat &frame /* rgb */, const BitMask &rawMask,
+                                  cv::Mat &out /* bgra */) {
+    TraceSpan span("matte");
+    BitMask mask = nextMask(rawMask);
+
+    if (guided_filter_)
+        packMatte(frame, guided_filter_->upsample(frame, mask.toMat()), out);
+    else
+        packMatte(frame, mask, out);
+}
+
+void BackgroundRemover::maskBackground(cv::Mat &frame /* rgb */,
+                                       const Background &background /* rgb */) {
+    applyMask(frame, getMask(frame).get(), background);
 }
 
 BackgroundRemover::~BackgroundRemover() {
-    TfLiteInterpreterDelete(interpreter_);
-#ifdef WITH_GL
-    TfLiteGpuDelegateV2Delete(gpu_delegate_);
-#endif
-    TfLiteInterpreterOptionsDelete(options_);
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex_);
+        stopping_ = true;
+    }
+    jobs_cv_.notify_all();
+    for (auto &w : workers_) w.join();
     TfLiteModelDelete(model_);
 }
@@ -1,8 +1,19 @@
 #ifndef BACKGROUND_REMOVER_H
 #define BACKGROUND_REMOVER_H
 
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <opencv2/imgproc.hpp>
+#include <thread>
+#include <vector>
 
+#include "background_selector.h"
+#include "bit_mask.h"
+#include "edge_blender.h"
+#include "guided_filter.h"
 #include "tensorflow/lite/c/c_api.h"
 
 class BackgroundRemover {
@@ -13,30 +24,124 @@ class BackgroundRemover {
         BodypixMobilenet,
     };
 
-    constexpr static int interpolation_method = cv::INTER_LINEAR;
+    constexpr static int interpolation_method = cv::INTER_LINEAR;  // for the model input
+
+    // All interpreters share model_, but each one has its own tensors (and delegate) and is
+    // created and invoked by its own worker thread (the GL delegate is bound to the thread it
+    // was created on), so consecutive frames can be processed in parallel.
+    struct Interpreter {
+        TfLiteInterpreterOptions *options;
+        TfLiteInterpreter *interpreter;
+        TfLiteTensor *input;
+        const TfLiteTensor *output;         // DeepLabV3 labels or bodypix segments
+        const TfLiteTensor *part_heatmaps;  // bodypix only, null if the model doesn't have them
+#ifdef WITH_GL
+        TfLiteDelegate *gpu_delegate;
+#endif
+    };
 
     const ModelType model_type_;
+    const uint32_t foreground_classes_;  // bit i set if DeepLabV3 label i is foreground
+    uint32_t excluded_parts_;            // bit i set if bodypix part i is background
+    const int morph_radius_, min_component_size_;
     TfLiteModel *model_;
-    TfLiteInterpreterOptions *options_;
-    TfLiteInterpreter *interpreter_;
-
-    TfLiteTensor *input_;
-    const TfLiteTensor *output_;
+    std::vector<Interpreter> interpreters_;
     int width_, height_, stride_;
 
-#ifdef WITH_GL
-    TfLiteDelegate *gpu_delegate_;
-#endif
+    std::unique_ptr<GuidedFilter> guided_filter_;  // null if refinement is disabled
+    std::unique_ptr<EdgeBlender> edge_blender_;    // null if edge blending is disabled
+
+    // Temporal smoothing state at mask resolution, only touched by applyMask().
+    const float temporal_alpha_, hysteresis_;
+    cv::Mat mask_average_;  // CV_32F exponential moving average of the masks
+    BitMask mask_state_;    // after hysteresis
+    BitMask prev_mask_;     // for the mask change metric
+
+    struct Job {
+        cv::Mat frame;
+        std::promise<BitMask> mask;
+    };
+
+    std::vector<std::thread> workers_;
+    std::mutex jobs_mutex_;
+    std::condition_variable jobs_cv_;
+    std::deque<Job> jobs_;
+    bool stopping_ = false;
 
     static ModelType parseModelType(const std::string &model_type);
+    static void findOutputs(const TfLiteInterpreter *interpreter, ModelType model_type,
+                            const TfLiteTensor *&output, const TfLiteTensor *&part_heatmaps);
+    static std::string checkTensors(ModelType model_type, const TfLiteTensor *input,
+                                    const TfLiteTensor *output,
+                                    const TfLiteTensor *part_heatmaps);
+    Interpreter makeInterpreter(int num_threads);
+    void runWorker(Interpreter *interpreter, int num_threads, int num_warmup_runs,
+                   std::promise<void> ready);
+    static void warmup(Interpreter *interpreter, int runs);
     cv::Mat makeInputTensor(const cv::Mat &img);
-    cv::Mat getMaskFromOutput();
+    BitMask getMaskFromOutput(const Interpreter *interpreter);
+    BitMask infer(Interpreter *interpreter, const cv::Mat &frame /* rgb */);
+    BitMask smoothMask(const BitMask &mask);
+    BitMask nextMask(const BitMask &rawMask);
 
    public:
+    struct Options {
+        // Total number of intra-op threads, split evenly among num_interpreters.
+        int num_threads = 4;
+        int num_interpreters = 1;
+        // Every interpreter is invoked this often before the constructor returns.
+        int num_warmup_runs = 2;
+        // Comma-separated DeepLabV3 labels that are kept, everything else is background.
+        std::string foreground_classes = "person";
+        // Comma-separated bodypix parts (e.g. left_hand,right_hand) that are treated as
+        // background. Ignored for models without part heatmaps.
+        std::string excluded_parts = "";
+        // Radius of the guided filter that snaps the upscaled mask to the frame's edges, 0 to
+        // upscale it bilinearly instead.
+        int refine_radius = 0;
+        float refine_eps = 1e-3;
+        // Radius of the opening and closing that remove speckles and holes from the low-res
+        // mask, 0 to disable.
+        int morph_radius = 0;
+        // Islands and holes with fewer pixels (at mask resolution) are removed, 0 to disable.
+        int min_component_size = 0;
+        // Weight of the newest mask in the per-pixel moving average, 1 disables smoothing.
+        float temporal_alpha = 1;
+        // A pixel only changes sides when the average is this far past .5.
+        float hysteresis = .2;
+        // Weight of the blurred background wrapped around the foreground's edge, and how far
+        // the foreground's color is moved towards the background's there. Both in [0, 1],
+        // 0 disables. Only an edge band of blend_radius pixels is touched.
+        float light_wrap = 0;
+        float color_match = 0;
+        int blend_radius = 16;
+    };
+
     BackgroundRemover(const std::string &model_filename, const std::string &model_type,
-                      int num_threads = 4);
+                      const Options &options);
+    // Why the constructor would fail to load the model, or an empty string if it would load:
+    // the type is valid, tflite can read the file and its tensors fit the type. Allocates a
+    // cpu interpreter for that, without warming it up. The constructor CHECKs instead. Warns
+    // if the model would ignore options.
+    static std::string checkModel(const std::string &model_filename,
+                                  const std::string &model_type, const Options &options);
     ~BackgroundRemover();
 
-    void maskBackground(cv::Mat &frame /* rgb */, const cv::Mat &maskImage /* rgb */);
+    int numInterpreters() const { return interpreters_.size(); }
+    // The model's input size, frames passed to getMask are resized to it.
+    cv::Size inputSize() const { return cv::Size(width_, height_); }
+
+    // Queues frame for inference on the next idle interpreter. The result is the low-res mask
+    // (set for background). Thread-safe; frame must not be modified until the mask is ready.
+    // frame may be a downscaled copy of the frame the mask is applied to.
+    std::future<BitMask> getMask(const cv::Mat &frame /* rgb */);
+    // Must be called from a single thread, with masks in frame order.
+    void applyMask(cv::Mat &frame /* rgb */, const BitMask &mask,
+                   const Background &background /* rgb */);
+    // Like applyMask, but instead of compositing writes the frame as BGR32 (b g r a in memory)
+    // to out, with the mask as alpha (0 for background).
+    void matteMask(const cv::Mat &frame /* rgb */, const BitMask &mask, cv::Mat &out /* bgra */);
+
+    void maskBackground(cv::Mat &frame /* rgb */, const Background &background /* rgb */);
 };
 #endif  // BACKGROUND_REMOVER_H
@@ -1,5 +1,6 @@
 #include "background_selector.h"
 
+#include <algorithm>
 #include <filesystem>
 #include <opencv2/imgproc.hpp>
 #include <sstream>
@@ -86,17 +87,14 @@ bool BackgroundSelector::changeMode(Mode m) {
     return true;
 }
 
-static cv::Mat makeSolidBackground(cv::Vec3b color, int width, int height) {
-    return cv::Mat(cv::Size(width, height), CV_8UC3, color);
-}
-
 void BackgroundSelector::changed() {
     if (curr_mode_ == Mode::Image) {
         LOG(INFO) << "Current background image: " << images_[curr_image_].filename;
-        curr_background_ = images_[curr_image_].mat;
+        curr_background_ = {++generation_, images_[curr_image_].mat};
     } else if (curr_mode_ == Mode::Color) {
         LOG(INFO) << "Current color: " << colors_[curr_color_];
-        curr_background_ = makeSolidBackground(colors_[curr_color_], width_, height_);
+        const cv::Vec3b c = colors_[curr_color_];
+        curr_background_ = {++generation_, cv::Mat(), {c[0], c[1], c[2]}};
     } else {
         CHECK(0) << "Unknown mode " << static_cast<int>(curr_mode_);
     }
@@ -146,4 +144,3 @@ void BackgroundSelector::selectNextImage() {
     changed();
 }
 
-cv::Mat BackgroundSelector::getBackground() const { return curr_background_; }
@@ -6,6 +6,16 @@
 #include <utility>
 #include <vector>
 
+// The current background in rgb, the format frames are composited in. Solid colors are kept
+// symbolic: image is empty and pixel holds the color.
+struct Background {
+    uint64_t generation;  // changes whenever the background does, never 0
+    cv::Mat image;
+    std::vector<unsigned char> pixel;
+
+    bool solid() const { return image.empty(); }
+};
+
 class BackgroundSelector {
     enum class Mode {
         Undefined,
@@ -27,7 +37,8 @@ class BackgroundSelector {
     int curr_image_;
     int curr_color_;
     Mode curr_mode_;
-    cv::Mat curr_background_;
+    uint64_t generation_ = 0;
+    Background curr_background_;
 
     void loadImages();
     bool changeMode(Mode m);
@@ -41,7 +52,8 @@ class BackgroundSelector {
     void selectNextColor();
     void selectPrevImage();
     void selectNextImage();
-    cv::Mat getBackground() const;
+    // The reference stays valid until the background is changed.
+    const Background &getBackground() const { return curr_background_; }
 };
 
 #endif  // BACKGROUND_SELECTOR_H
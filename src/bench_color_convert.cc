@@ -0,0 +1,94 @@
+// Times the conversions of color_convert.h against cv::cvtColor, where it has an equivalent, on
+// random frames of --width x --height. Prints one row per format with the milliseconds per
+// frame of each, and - where cvtColor has no equivalent.
+
+#include <linux/videodev2.h>
+#include <stdio.h>
+
+#include <functional>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "color_convert.h"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "timestamp.h"
+
+DEFINE_int32(width, 1280, "Frame width");
+DEFINE_int32(height, 720, "Frame height");
+DEFINE_int32(iterations, 200, "Conversions per measurement");
+DEFINE_int32(factor, 1, "Downscaling factor of convertRgb and convertToRgb");
+
+namespace {
+
+struct Format {
+    const char *name;
+    uint32_t pixelformat;
+    int to_rgb, from_rgb;  // cv::ColorConversionCodes, -1 for none
+};
+
+// The cvtColor codes that produce the same bytes, up to rounding. OpenCV has no a r g b order
+// and packs neither NV12 nor 4:2:2 from rgb.
+const Format formats[] = {
+    {"grey", V4L2_PIX_FMT_GREY, cv::COLOR_GRAY2RGB, cv::COLOR_RGB2GRAY},
+    {"yuyv", V4L2_PIX_FMT_YUYV, cv::COLOR_YUV2RGB_YUYV, -1},
+    {"uyvy", V4L2_PIX_FMT_UYVY, cv::COLOR_YUV2RGB_UYVY, -1},
+    {"nv12", V4L2_PIX_FMT_NV12, cv::COLOR_YUV2RGB_NV12, -1},
+    {"i420", V4L2_PIX_FMT_YUV420, cv::COLOR_YUV2RGB_I420, cv::COLOR_RGB2YUV_I420},
+    {"rgb24", V4L2_PIX_FMT_RGB24, -1, -1},
+    {"bgr24", V4L2_PIX_FMT_BGR24, cv::COLOR_BGR2RGB, cv::COLOR_RGB2BGR},
+    {"rgb32", V4L2_PIX_FMT_RGB32, -1, -1},
+    {"bgr32", V4L2_PIX_FMT_BGR32, cv::COLOR_BGRA2RGB, cv::COLOR_RGB2BGRA},
+};
+
+// Milliseconds per call of f, after a warmup call.
+double measure(const std::function<void()> &f) {
+    f();
+    const int64_t begin = monotonicNs();
+    for (int i = 0; i < FLAGS_iterations; i++) f();
+    return (monotonicNs() - begin) / 1e6 / FLAGS_iterations;
+}
+
+void print(double ms) {
+    if (ms < 0)
+        printf("%13s", "-");
+    else
+        printf("%13.3f", ms);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    google::ParseCommandLineFlags(&argc, &argv, false);
+    google::InitGoogleLogging(argv[0]);
+    CHECK_GE(FLAGS_iterations, 1);
+    CHECK_GE(FLAGS_factor, 1);
+    const cv::Size size(FLAGS_width, FLAGS_height);
+    const cv::Size small(size.width / FLAGS_factor, size.height / FLAGS_factor);
+    CHECK(size.width % 2 == 0 && size.height % 2 == 0 && small.width % 2 == 0 &&
+          small.height % 2 == 0)
+        << "The yuv formats need even dimensions, after downscaling too";
+
+    cv::Mat rgb(size, CV_8UC3);
+    cv::randu(rgb, 0, 256);
+    printf("%-8s%13s%13s%13s%13s\n", "format", "to rgb ms", "cvtColor ms", "from rgb ms",
+           "cvtColor ms");
+    for (const Format &f : formats) {
+        cv::Mat frame = makeFrame(size, f.pixelformat), out, cv_out;
+        cv::randu(frame, 0, 256);
+        printf("%-8s", f.name);
+        print(measure([&] { convertToRgb(frame, size, f.pixelformat, out, FLAGS_factor); }));
+        // cvtColor doesn't downscale, so it is followed by a resize to the same size.
+        print(f.to_rgb < 0 ? -1 : measure([&] {
+            cv::cvtColor(frame, cv_out, f.to_rgb);
+            if (FLAGS_factor > 1) cv::resize(cv_out, cv_out, small, 0, 0, cv::INTER_AREA);
+        }));
+        print(measure([&] { convertRgb(rgb, f.pixelformat, out, FLAGS_factor); }));
+        print(f.from_rgb < 0 ? -1 : measure([&] {
+            cv::Mat src = rgb;
+            if (FLAGS_factor > 1) cv::resize(rgb, src, small, 0, 0, cv::INTER_AREA);
+            cv::cvtColor(src, cv_out, f.from_rgb);
+        }));
+        printf("\n");
+    }
+}
@@ -0,0 +1,148 @@
+#include "bit_mask.h"
+
+#include <array>
+#include <cstring>
+
+#include "glog/logging.h"
+
+// expand_table[b] has byte i set to bit i of b.
+static const std::array<uint64_t, 256> expand_table = [] {
+    std::array<uint64_t, 256> ret;
+    for (int b = 0; b < 256; b++) {
+        ret[b] = 0;
+        for (int i = 0; i < 8; i++) ret[b] |= (uint64_t)((b >> i) & 1) << (i * 8);
+    }
+    return ret;
+}();
+
+BitMask::BitMask(int width, int height)
+    : width_(width), height_(height), words_((width + 63) / 64), bits_(words_ * height, 0) {}
+
+cv::Mat BitMask::toMat() const {
+    cv::Mat ret(height_, width_, CV_8U);
+    for (int y = 0; y < height_; y++) {
+        unsigned char *m = ret.ptr<unsigned char>(y);
+        const uint64_t *r = row(y);
+        for (int x = 0; x < width_; x++) m[x] = (r[x / 64] >> (x % 64)) & 1;
+    }
+    return ret;
+}
+
+void BitMask::set(int x, int y, bool v) {
+    uint64_t bit = (uint64_t)1 << (x % 64);
+    if (v)
+        row(y)[x / 64] |= bit;
+    else
+        row(y)[x / 64] &= ~bit;
+}
+
+void BitMask::expandRow(int y, unsigned char *out) const {
+    static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "expand_table assumes little endian");
+    const uint64_t *r = row(y);
+    int x = 0;
+    for (; x + 8 <= width_; x += 8) {
+        uint64_t bytes = expand_table[(r[x / 64] >> (x % 64)) & 0xff];
+        std::memcpy(out + x, &bytes, 8);
+    }
+    for (; x < width_; x++) out[x] = (r[x / 64] >> (x % 64)) & 1;
+}
+
+size_t BitMask::count() const {
+    size_t ret = 0;
+    for (uint64_t w : bits_) ret += __builtin_popcountll(w);
+    return ret;
+}
+
+size_t BitMask::countDifferent(const BitMask &o) const {
+    CHECK(sameSize(o));
+    size_t ret = 0;
+    for (size_t i = 0; i < bits_.size(); i++) ret += __builtin_popcountll(bits_[i] ^ o.bits_[i]);
+    return ret;
+}
+
+uint64_t BitMask::lastWordMask() const {
+    return width_ % 64 ? ((uint64_t)1 << (width_ % 64)) - 1 : ~(uint64_t)0;
+}
+
+// One 3x3 step, 64 pixels at a time: combine each row with its neighbours shifted by one pixel,
+// then each row with the rows above and below.
+BitMask BitMask::morph3x3(bool erode) const {
+    const uint64_t outside = erode ? ~(uint64_t)0 : 0;
+    const uint64_t last = lastWordMask();
+    auto combine = [erode](uint64_t a, uint64_t b) { return erode ? a & b : a | b; };
+
+    BitMask horizontal(width_, height_);
+    for (int y = 0; y < height_; y++) {
+        const uint64_t *in = row(y);
+        uint64_t *out = horizontal.row(y);
+        for (int w = 0; w < words_; w++) {
+            // Padding bits act like pixels outside the mask.
+            uint64_t cur = w == words_ - 1 ? (in[w] & last) | (outside & ~last) : in[w];
+            uint64_t prev = w > 0 ? in[w - 1] : outside;
+            uint64_t next = w + 1 < words_ ? in[w + 1] : outside;
+            if (w + 1 == words_ - 1) next = (next & last) | (outside & ~last);
+            uint64_t left = (cur << 1) | (prev >> 63);   // pixel x-1 at x
+            uint64_t right = (cur >> 1) | (next << 63);  // pixel x+1 at x
+            out[w] = combine(combine(left, cur), right);
+        }
+    }
+
+    BitMask ret(width_, height_);
+    for (int y = 0; y < height_; y++) {
+        const uint64_t *above = y > 0 ? horizontal.row(y - 1) : nullptr;
+        const uint64_t *below = y + 1 < height_ ? horizontal.row(y + 1) : nullptr;
+        const uint64_t *cur = horizontal.row(y);
+        uint64_t *out = ret.row(y);
+        for (int w = 0; w < words_; w++)
+            out[w] = combine(combine(above ? above[w] : outside, cur[w]),
+                             below ? below[w] : outside);
+        out[words_ - 1] &= last;
+    }
+    return ret;
+}
+
+BitMask BitMask::erode(int r) const {
+    BitMask ret = *this;
+    for (int i = 0; i < r; i++) ret = ret.morph3x3(true);
+    return ret;
+}
+
+BitMask BitMask::dilate(int r) const {
+    BitMask ret = *this;
+    for (int i = 0; i < r; i++) ret = ret.morph3x3(false);
+    return ret;
+}
+
+void BitMask::removeSmallComponents(int min_size) {
+    std::vector<bool> visited(width_ * height_, false);
+    std::vector<int> component, stack;
+
+    for (int start = 0; start < width_ * height_; start++) {
+        if (visited[start]) continue;
+        const bool v = get(start % width_, start / width_);
+
+        component.clear();
+        stack.push_back(start);
+        visited[start] = true;
+        while (!stack.empty()) {
+            int p = stack.back();
+            stack.pop_back();
+            component.push_back(p);
+            int x = p % width_, y = p / width_;
+            auto visit = [&](int nx, int ny) {
+                int n = ny * width_ + nx;
+                if (!visited[n] && get(nx, ny) == v) {
+                    visited[n] = true;
+                    stack.push_back(n);
+                }
+            };
+            if (x > 0) visit(x - 1, y);
+            if (x + 1 < width_) visit(x + 1, y);
+            if (y > 0) visit(x, y - 1);
+            if (y + 1 < height_) visit(x, y + 1);
+        }
+
+        if (component.size() < min_size)
+            for (int p : component) set(p % width_, p / width_, !v);
+    }
+}
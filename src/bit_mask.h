@@ -0,0 +1,49 @@
+#ifndef BIT_MASK_H
+#define BIT_MASK_H
+
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+// A binary mask with one bit per pixel. Each row starts at a 64 bit word boundary, pixel x of a
+// row is bit x % 64 of word x / 64, and the padding bits at the end of a row are always 0.
+class BitMask {
+    int width_, height_, words_;  // words_ per row
+    std::vector<uint64_t> bits_;
+
+    uint64_t lastWordMask() const;
+    BitMask morph3x3(bool erode) const;
+
+   public:
+    BitMask() : width_(0), height_(0), words_(0) {}
+    BitMask(int width, int height);
+    // CV_8U with values 0/1.
+    cv::Mat toMat() const;
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int wordsPerRow() const { return words_; }
+    uint64_t *row(int y) { return &bits_[y * words_]; }
+    const uint64_t *row(int y) const { return &bits_[y * words_]; }
+    bool empty() const { return bits_.empty(); }
+    bool sameSize(const BitMask &o) const { return width_ == o.width_ && height_ == o.height_; }
+    bool get(int x, int y) const { return (row(y)[x / 64] >> (x % 64)) & 1; }
+    void set(int x, int y, bool v);
+
+    // Writes row y as width() bytes with values 0/1, 8 pixels at a time.
+    void expandRow(int y, unsigned char *out) const;
+    // Number of set pixels, and of pixels that differ from o (which must be the same size).
+    size_t count() const;
+    size_t countDifferent(const BitMask &o) const;
+
+    // Morphology with a (2r+1)x(2r+1) square, pixels outside the mask don't erode or dilate.
+    BitMask erode(int r) const;
+    BitMask dilate(int r) const;
+    BitMask open(int r) const { return erode(r).dilate(r); }
+    BitMask close(int r) const { return dilate(r).erode(r); }
+
+    // Flips 4-connected regions of set or unset pixels with fewer than min_size pixels.
+    void removeSmallComponents(int min_size);
+};
+
+#endif  // BIT_MASK_H
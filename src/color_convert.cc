@@ -0,0 +1,363 @@
+#include "color_convert.h"
+
+#include <linux/videodev2.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "glog/logging.h"
+#include "parallel.h"
+#include "pixel_format.h"
+
+// Each row kernel is compiled once per instruction set and the best one for the CPU is picked
+// when the program is loaded.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MULTIVERSIONED __attribute__((target_clones("avx2", "default")))
+#else
+#define MULTIVERSIONED
+#endif
+
+namespace {
+
+// 8 bit fixed point, limited range.
+struct Coefficients {
+    int yr, yg, yb, ur, ug, ub, vr, vg, vb;  // rgb to yuv
+    int rv, gu, gv, bu;                      // yuv to rgb, with 298 for y
+};
+constexpr Coefficients bt601 = {66, 129, 25, -38, -74, 112, 112, -94, -18, 409, -100, -208, 516};
+constexpr Coefficients bt709 = {47, 157, 16, -26, -87, 112, 112, -102, -10, 459, -55, -136, 541};
+
+const Coefficients &coefficients(ColorMatrix matrix) {
+    return matrix == ColorMatrix::BT709 ? bt709 : bt601;
+}
+
+inline unsigned char clamp(int v) { return std::min(std::max(v, 0), 255); }
+
+// These stay within 16..240 for any rgb, so they don't need clamping.
+inline unsigned char toY(const Coefficients &k, int r, int g, int b) {
+    return ((k.yr * r + k.yg * g + k.yb * b + 128) >> 8) + 16;
+}
+inline unsigned char toU(const Coefficients &k, int r, int g, int b) {
+    return ((k.ur * r + k.ug * g + k.ub * b + 128) >> 8) + 128;
+}
+inline unsigned char toV(const Coefficients &k, int r, int g, int b) {
+    return ((k.vr * r + k.vg * g + k.vb * b + 128) >> 8) + 128;
+}
+
+// The yuv kernels work on blocks of pixels, deinterleaved into planar lanes first, so that every
+// loop has a constant stride and vectorizes. Chroma is spread to one lane entry per pixel.
+constexpr int block = 32;
+
+inline void deinterleaveRgb(const unsigned char *rgb, int n, short *r, short *g, short *b) {
+    for (int i = 0; i < n; i++) r[i] = rgb[i * 3], g[i] = rgb[i * 3 + 1], b[i] = rgb[i * 3 + 2];
+}
+
+// At most block pixels.
+inline void toRgb(const Coefficients &k, const short *y, const short *u, const short *v, int n,
+                  unsigned char *rgb) {
+    unsigned char r[block], g[block], b[block];
+    for (int i = 0; i < n; i++) {
+        const int c = 298 * (y[i] - 16) + 128, d = u[i] - 128, e = v[i] - 128;
+        r[i] = clamp((c + k.rv * e) >> 8);
+        g[i] = clamp((c + k.gu * d + k.gv * e) >> 8);
+        b[i] = clamp((c + k.bu * d) >> 8);
+    }
+    for (int i = 0; i < n; i++) rgb[i * 3] = r[i], rgb[i * 3 + 1] = g[i], rgb[i * 3 + 2] = b[i];
+}
+
+template <bool UYVY>
+inline void packYuv422(const unsigned char *rgb, int n, const Coefficients &k, unsigned char *out) {
+    short r[block], g[block], b[block];
+    unsigned char y[block], u[block / 2], v[block / 2];
+    for (int x = 0; x + 1 < n; x += block) {
+        const int m = std::min(block, n - x) & ~1;
+        deinterleaveRgb(rgb + x * 3, m, r, g, b);
+        for (int i = 0; i < m; i++) y[i] = toY(k, r[i], g[i], b[i]);
+        for (int j = 0; j < m / 2; j++) {
+            const int ra = (r[j * 2] + r[j * 2 + 1] + 1) >> 1,
+                      ga = (g[j * 2] + g[j * 2 + 1] + 1) >> 1,
+                      ba = (b[j * 2] + b[j * 2 + 1] + 1) >> 1;
+            u[j] = toU(k, ra, ga, ba);
+            v[j] = toV(k, ra, ga, ba);
+        }
+        unsigned char *o = out + x * 2;
+        for (int j = 0; j < m / 2; j++) {
+            o[j * 4 + (UYVY ? 1 : 0)] = y[j * 2];
+            o[j * 4 + (UYVY ? 3 : 2)] = y[j * 2 + 1];
+            o[j * 4 + (UYVY ? 0 : 1)] = u[j];
+            o[j * 4 + (UYVY ? 2 : 3)] = v[j];
+        }
+    }
+}
+
+template <bool UYVY>
+inline void unpackYuv422(const unsigned char *src, int n, const Coefficients &k,
+                         unsigned char *rgb) {
+    short y[block], u[block], v[block];
+    for (int x = 0; x + 1 < n; x += block) {
+        const int m = std::min(block, n - x) & ~1;
+        const unsigned char *s = src + x * 2;
+        for (int j = 0; j < m / 2; j++) {
+            y[j * 2] = s[j * 4 + (UYVY ? 1 : 0)];
+            y[j * 2 + 1] = s[j * 4 + (UYVY ? 3 : 2)];
+            u[j * 2] = u[j * 2 + 1] = s[j * 4 + (UYVY ? 0 : 1)];
+            v[j * 2] = v[j * 2 + 1] = s[j * 4 + (UYVY ? 2 : 3)];
+        }
+        toRgb(k, y, u, v, m, rgb + x * 3);
+    }
+}
+
+MULTIVERSIONED
+void packRow(const unsigned char *rgb, int n, uint32_t pixelformat, const Coefficients &k,
+             unsigned char *out) {
+    switch (pixelformat) {
+        case V4L2_PIX_FMT_GREY:  // full range luma
+            for (int i = 0; i < n; i++, rgb += 3)
+                out[i] = (77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2] + 128) >> 8;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            std::memcpy(out, rgb, n * 3);
+            break;
+        case V4L2_PIX_FMT_BGR24:
+            for (int i = 0; i < n; i++, rgb += 3, out += 3)
+                out[0] = rgb[2], out[1] = rgb[1], out[2] = rgb[0];
+            break;
+        case V4L2_PIX_FMT_RGB32:
+            for (int i = 0; i < n; i++, rgb += 3, out += 4)
+                out[0] = 0xff, out[1] = rgb[0], out[2] = rgb[1], out[3] = rgb[2];
+            break;
+        case V4L2_PIX_FMT_BGR32:
+            for (int i = 0; i < n; i++, rgb += 3, out += 4)
+                out[0] = rgb[2], out[1] = rgb[1], out[2] = rgb[0], out[3] = 0xff;
+            break;
+        case V4L2_PIX_FMT_YUYV:
+            packYuv422<false>(rgb, n, k, out);
+            break;
+        case V4L2_PIX_FMT_UYVY:
+            packYuv422<true>(rgb, n, k, out);
+            break;
+        default:
+            CHECK(0) << "Can't convert rgb to format " << pixelformat;
+    }
+}
+
+// Two rows of NV12 (uv_step 2, v = u + 1) or I420 (uv_step 1).
+MULTIVERSIONED
+void packPlanarRows(const unsigned char *rgb0, const unsigned char *rgb1, int n,
+                    const Coefficients &k, unsigned char *y0, unsigned char *y1, unsigned char *u,
+                    unsigned char *v, int uv_step) {
+    short r0[block], g0[block], b0[block], r1[block], g1[block], b1[block];
+    unsigned char us[block / 2], vs[block / 2];
+    for (int x = 0; x < n; x += block) {
+        const int m = std::min(block, n - x);
+        deinterleaveRgb(rgb0 + x * 3, m, r0, g0, b0);
+        deinterleaveRgb(rgb1 + x * 3, m, r1, g1, b1);
+        for (int i = 0; i < m; i++) {
+            y0[x + i] = toY(k, r0[i], g0[i], b0[i]);
+            y1[x + i] = toY(k, r1[i], g1[i], b1[i]);
+        }
+        for (int j = 0; j < m / 2; j++) {
+            const int r = (r0[j * 2] + r0[j * 2 + 1] + r1[j * 2] + r1[j * 2 + 1] + 2) >> 2,
+                      g = (g0[j * 2] + g0[j * 2 + 1] + g1[j * 2] + g1[j * 2 + 1] + 2) >> 2,
+                      b = (b0[j * 2] + b0[j * 2 + 1] + b1[j * 2] + b1[j * 2 + 1] + 2) >> 2;
+            us[j] = toU(k, r, g, b);
+            vs[j] = toV(k, r, g, b);
+        }
+        const int c = x / 2;
+        if (uv_step == 2) {
+            for (int j = 0; j < m / 2; j++) u[(c + j) * 2] = us[j], u[(c + j) * 2 + 1] = vs[j];
+        } else {
+            std::memcpy(u + c, us, m / 2);
+            std::memcpy(v + c, vs, m / 2);
+        }
+    }
+}
+
+// For planar formats, src is the row in the y plane and u and v point to the row's chroma.
+MULTIVERSIONED
+void unpackRow(const unsigned char *src, const unsigned char *u, const unsigned char *v,
+               int uv_step, int n, uint32_t pixelformat, const Coefficients &k,
+               unsigned char *rgb) {
+    switch (pixelformat) {
+        case V4L2_PIX_FMT_GREY:
+            for (int i = 0; i < n; i++, rgb += 3) rgb[0] = rgb[1] = rgb[2] = src[i];
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            std::memcpy(rgb, src, n * 3);
+            break;
+        case V4L2_PIX_FMT_BGR24:
+            for (int i = 0; i < n; i++, src += 3, rgb += 3)
+                rgb[0] = src[2], rgb[1] = src[1], rgb[2] = src[0];
+            break;
+        case V4L2_PIX_FMT_RGB32:
+            for (int i = 0; i < n; i++, src += 4, rgb += 3)
+                rgb[0] = src[1], rgb[1] = src[2], rgb[2] = src[3];
+            break;
+        case V4L2_PIX_FMT_BGR32:
+            for (int i = 0; i < n; i++, src += 4, rgb += 3)
+                rgb[0] = src[2], rgb[1] = src[1], rgb[2] = src[0];
+            break;
+        case V4L2_PIX_FMT_YUYV:
+            unpackYuv422<false>(src, n, k, rgb);
+            break;
+        case V4L2_PIX_FMT_UYVY:
+            unpackYuv422<true>(src, n, k, rgb);
+            break;
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_YUV420: {
+            short y[block], us[block], vs[block];
+            for (int x = 0; x < n; x += block) {
+                const int m = std::min(block, n - x), c = x / 2;
+                for (int i = 0; i < m; i++) y[i] = src[x + i];
+                if (uv_step == 2) {
+                    for (int j = 0; j < m / 2; j++) {
+                        us[j * 2] = us[j * 2 + 1] = u[(c + j) * 2];
+                        vs[j * 2] = vs[j * 2 + 1] = u[(c + j) * 2 + 1];
+                    }
+                } else {
+                    for (int j = 0; j < m / 2; j++) {
+                        us[j * 2] = us[j * 2 + 1] = u[c + j];
+                        vs[j * 2] = vs[j * 2 + 1] = v[c + j];
+                    }
+                }
+                toRgb(k, y, us, vs, m, rgb + x * 3);
+            }
+            break;
+        }
+        default:
+            CHECK(0) << "Can't convert format " << pixelformat << " to rgb";
+    }
+}
+
+// Averages factor x factor blocks of rgb rows (the first one at rows, each stride bytes apart)
+// into one row of n pixels.
+MULTIVERSIONED
+void boxRow(const unsigned char *rows, size_t stride, int factor, int n, unsigned char *out) {
+    const int area = factor * factor;
+    for (int x = 0; x < n; x++) {
+        int sum[3] = {0, 0, 0};
+        for (int dy = 0; dy < factor; dy++) {
+            const unsigned char *p = rows + dy * stride + x * factor * 3;
+            for (int dx = 0; dx < factor * 3; dx += 3)
+                for (int c = 0; c < 3; c++) sum[c] += p[dx + c];
+        }
+        for (int c = 0; c < 3; c++) out[x * 3 + c] = (sum[c] + area / 2) / area;
+    }
+}
+
+}  // namespace
+
+ColorMatrix parseColorMatrix(const std::string &matrix) {
+    if (matrix == "bt601") return ColorMatrix::BT601;
+    if (matrix == "bt709") return ColorMatrix::BT709;
+    CHECK(0) << "Unknown color matrix " << matrix;
+    return ColorMatrix::BT601;
+}
+
+bool isPlanar(uint32_t pixelformat) {
+    return pixelformat == V4L2_PIX_FMT_NV12 || pixelformat == V4L2_PIX_FMT_YUV420;
+}
+
+cv::Mat makeFrame(cv::Size size, uint32_t pixelformat) {
+    if (isPlanar(pixelformat)) return cv::Mat(size.height * 3 / 2, size.width, CV_8U);
+    return cv::Mat(size, CV_8UC(bytesPerPixel(pixelformat)));
+}
+
+void convertRgbPixels(const unsigned char *rgb, int n, uint32_t pixelformat, unsigned char *out,
+                      ColorMatrix matrix) {
+    packRow(rgb, n, pixelformat, coefficients(matrix), out);
+}
+
+static void checkSubsampling(cv::Size size, uint32_t pixelformat) {
+    if (pixelformat == V4L2_PIX_FMT_YUYV || pixelformat == V4L2_PIX_FMT_UYVY ||
+        isPlanar(pixelformat))
+        CHECK(size.width % 2 == 0) << "Chroma subsampled formats need an even width";
+    if (isPlanar(pixelformat))
+        CHECK(size.height % 2 == 0) << "Planar formats need an even height";
+}
+
+void convertRgb(const cv::Mat &rgb, uint32_t pixelformat, cv::Mat &out, int factor,
+                ColorMatrix matrix) {
+    CHECK_EQ(rgb.type(), CV_8UC3);
+    CHECK_GE(factor, 1);
+    const cv::Size size(rgb.cols / factor, rgb.rows / factor);
+    checkSubsampling(size, pixelformat);
+    const Coefficients &k = coefficients(matrix);
+
+    if (isPlanar(pixelformat))
+        out.create(size.height * 3 / 2, size.width, CV_8U);
+    else
+        out.create(size, CV_8UC(bytesPerPixel(pixelformat)));
+
+    // The rgb row y at the output size, downscaled into tmp if needed.
+    auto source = [&](int y, unsigned char *tmp) -> const unsigned char * {
+        if (factor == 1) return rgb.ptr<unsigned char>(y);
+        boxRow(rgb.ptr<unsigned char>(y * factor), rgb.step, factor, size.width, tmp);
+        return tmp;
+    };
+
+    if (!isPlanar(pixelformat)) {
+        parallelRows(size.height, [&](int begin, int end) {
+            std::vector<unsigned char> tmp(factor > 1 ? size.width * 3 : 0);
+            for (int y = begin; y < end; y++)
+                packRow(source(y, tmp.data()), size.width, pixelformat, k,
+                        out.ptr<unsigned char>(y));
+        });
+        return;
+    }
+
+    CHECK(out.isContinuous());
+    const bool nv12 = pixelformat == V4L2_PIX_FMT_NV12;
+    const int w = size.width, h = size.height;
+    unsigned char *chroma = out.data + (size_t)w * h;
+    parallelRows(h / 2, [&](int begin, int end) {
+        std::vector<unsigned char> tmp0(factor > 1 ? w * 3 : 0), tmp1(tmp0.size());
+        for (int y2 = begin; y2 < end; y2++) {
+            unsigned char *u = nv12 ? chroma + (size_t)y2 * w : chroma + (size_t)y2 * (w / 2);
+            unsigned char *v = nv12 ? u + 1 : u + (size_t)(w / 2) * (h / 2);
+            packPlanarRows(source(y2 * 2, tmp0.data()), source(y2 * 2 + 1, tmp1.data()), w, k,
+                           out.ptr<unsigned char>(y2 * 2), out.ptr<unsigned char>(y2 * 2 + 1), u,
+                           v, nv12 ? 2 : 1);
+        }
+    });
+}
+
+void convertToRgb(const cv::Mat &frame, cv::Size size, uint32_t pixelformat, cv::Mat &rgb,
+                  int factor, ColorMatrix matrix) {
+    CHECK_GE(factor, 1);
+    checkSubsampling(size, pixelformat);
+    CHECK_EQ(frame.cols, size.width);
+    CHECK_EQ(frame.rows, isPlanar(pixelformat) ? size.height * 3 / 2 : size.height);
+    CHECK_EQ(frame.elemSize(), isPlanar(pixelformat) ? 1 : bytesPerPixel(pixelformat));
+    const Coefficients &k = coefficients(matrix);
+    const cv::Size out_size(size.width / factor, size.height / factor);
+    rgb.create(out_size, CV_8UC3);
+
+    const bool nv12 = pixelformat == V4L2_PIX_FMT_NV12;
+    const int w = size.width, h = size.height;
+    CHECK(!isPlanar(pixelformat) || frame.isContinuous());
+    const unsigned char *chroma = frame.data + (size_t)w * h;
+
+    auto unpack = [&](int y, unsigned char *out) {
+        const unsigned char *u = nullptr, *v = nullptr;
+        if (isPlanar(pixelformat)) {
+            u = nv12 ? chroma + (size_t)(y / 2) * w : chroma + (size_t)(y / 2) * (w / 2);
+            v = nv12 ? u + 1 : chroma + (size_t)(w / 2) * (h / 2) + (size_t)(y / 2) * (w / 2);
+        }
+        unpackRow(frame.ptr<unsigned char>(y), u, v, nv12 ? 2 : 1, w, pixelformat, k, out);
+    };
+
+    // Downscaling unpacks factor full-res rows at a time into a buffer that stays in cache.
+    parallelRows(out_size.height, [&](int begin, int end) {
+        std::vector<unsigned char> tmp(factor > 1 ? (size_t)factor * w * 3 : 0);
+        for (int y = begin; y < end; y++) {
+            if (factor == 1) {
+                unpack(y, rgb.ptr<unsigned char>(y));
+                continue;
+            }
+            for (int dy = 0; dy < factor; dy++) unpack(y * factor + dy, tmp.data() + dy * w * 3);
+            boxRow(tmp.data(), (size_t)w * 3, factor, out_size.width, rgb.ptr<unsigned char>(y));
+        }
+    });
+}
@@ -0,0 +1,40 @@
+#ifndef COLOR_CONVERT_H
+#define COLOR_CONVERT_H
+
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <string>
+
+// Conversions between rgb and the v4l2 pixel formats we see in the field: GREY, YUYV, UYVY,
+// NV12, I420, RGB24, BGR24, RGB32 (a r g b in memory) and BGR32 (b g r a in memory). The row
+// kernels are vectorized by the compiler for several instruction sets, picked at runtime.
+//
+// Frames are Mats with one element per pixel for packed formats (e.g. CV_8UC2 for YUYV), and
+// continuous CV_8U Mats of height * 3 / 2 rows for the planar NV12 and I420.
+
+// YUV formats are limited range.
+enum class ColorMatrix {
+    BT601,
+    BT709,
+};
+ColorMatrix parseColorMatrix(const std::string &matrix);
+
+bool isPlanar(uint32_t pixelformat);
+// Allocates a frame of size pixels.
+cv::Mat makeFrame(cv::Size size, uint32_t pixelformat);
+
+// Converts n rgb pixels (n even for YUYV and UYVY) to a packed pixelformat.
+void convertRgbPixels(const unsigned char *rgb, int n, uint32_t pixelformat, unsigned char *out,
+                      ColorMatrix matrix = ColorMatrix::BT601);
+
+// Converts a CV_8UC3 rgb image to pixelformat, downscaling it by an integer factor (a box
+// filter) in the same pass. out is reallocated only if its size or type don't match.
+void convertRgb(const cv::Mat &rgb, uint32_t pixelformat, cv::Mat &out, int factor = 1,
+                ColorMatrix matrix = ColorMatrix::BT601);
+
+// Converts a frame of size pixels in pixelformat to CV_8UC3 rgb, downscaling it by an integer
+// factor in the same pass. rgb must not share memory with frame.
+void convertToRgb(const cv::Mat &frame, cv::Size size, uint32_t pixelformat, cv::Mat &rgb,
+                  int factor = 1, ColorMatrix matrix = ColorMatrix::BT601);
+
+#endif  // COLOR_CONVERT_H
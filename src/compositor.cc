@@ -0,0 +1,201 @@
+#include "compositor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <execution>
+#include <numeric>
+
+#include "glog/logging.h"
+#include "metrics.h"
+#include "parallel.h"
+
+constexpr int tile_size = 64;
+
+// Same sample positions as cv::resize with INTER_LINEAR.
+static void samplePosition(int i, float scale, int size, int *i0, int *i1, int *w) {
+    float f = std::max(0.f, (i + .5f) * scale - .5f);
+    *i0 = std::min((int)f, size - 1);
+    *i1 = std::min(*i0 + 1, size - 1);
+    *w = (f - *i0) * 256 + .5f;
+}
+
+MaskSampler::MaskSampler(const BitMask &mask, cv::Size size)
+    : mask_(mask.height(), mask.width(), CV_8U),
+      size_(size),
+      x0_(size.width),
+      x1_(size.width),
+      wx_(size.width) {
+    for (int y = 0; y < mask.height(); y++) mask.expandRow(y, mask_.ptr<unsigned char>(y));
+    const float scale = (float)mask.width() / size.width;
+    for (int x = 0; x < size.width; x++)
+        samplePosition(x, scale, mask.width(), &x0_[x], &x1_[x], &wx_[x]);
+}
+
+void MaskSampler::sampleRow(int y, unsigned char *row, int channels, int begin, int end) const {
+    int y0, y1, wy;
+    samplePosition(y, (float)mask_.rows / size_.height, mask_.rows, &y0, &y1, &wy);
+    const unsigned char *m0 = mask_.ptr<unsigned char>(y0), *m1 = mask_.ptr<unsigned char>(y1);
+
+    // The mask is 0/1, so the interpolated value is at most 256 * 256. Like cv::resize on the
+    // 0/1 mask, anything from .5 up is background.
+    for (int x = begin; x < end; x++) {
+        int top = m0[x0_[x]] * (256 - wx_[x]) + m0[x1_[x]] * wx_[x];
+        int bottom = m1[x0_[x]] * (256 - wx_[x]) + m1[x1_[x]] * wx_[x];
+        unsigned char v = top * (256 - wy) + bottom * wy >= 256 * 128 ? 0xff : 0;
+        for (int c = 0; c < channels; c++) row[(x - begin) * channels + c] = v;
+    }
+}
+
+MaskSampler::Coverage MaskSampler::classify(const cv::Rect &rect) const {
+    int top, bottom, unused;
+    samplePosition(rect.y, (float)mask_.rows / size_.height, mask_.rows, &top, &unused, &unused);
+    samplePosition(rect.y + rect.height - 1, (float)mask_.rows / size_.height, mask_.rows,
+                   &unused, &bottom, &unused);
+    const int left = x0_[rect.x], right = x1_[rect.x + rect.width - 1];
+
+    int set = 0;
+    for (int y = top; y <= bottom; y++) {
+        const unsigned char *m = mask_.ptr<unsigned char>(y);
+        for (int x = left; x <= right; x++) set += m[x];
+    }
+
+    if (set == 0) return Coverage::Foreground;
+    if (set == (bottom - top + 1) * (right - left + 1)) return Coverage::Background;
+    return Coverage::Mixed;
+}
+
+// Returns a function giving the background pixels from (x, y) on. For a solid color that is
+// always the same row of width pixels, which stays in L1 however large the frame is.
+static auto backgroundRows(const cv::Mat &frame, const Background &background, int width,
+                           std::vector<unsigned char> *solid_row) {
+    if (background.solid()) {
+        CHECK_EQ(background.pixel.size(), 3);
+        solid_row->resize(width * 3);
+        for (int x = 0; x < width; x++)
+            std::memcpy(solid_row->data() + x * 3, background.pixel.data(), 3);
+    } else {
+        CHECK_EQ(background.image.type(), CV_8UC3);
+        CHECK(frame.size() == background.image.size());
+    }
+
+    return [&background, solid_row](int y, int x) -> const unsigned char * {
+        return background.solid() ? solid_row->data()
+                                  : background.image.ptr<unsigned char>(y) + x * 3;
+    };
+}
+
+void compositeMask(cv::Mat &frame /* rgb */, const Background &background /* rgb */,
+                   const BitMask &mask) {
+    CHECK_EQ(frame.type(), CV_8UC3);
+    std::vector<unsigned char> solid_row;
+    auto backgroundRow = backgroundRows(frame, background, tile_size, &solid_row);
+
+    MaskSampler sampler(mask, frame.size());
+    const int tiles_x = (frame.cols + tile_size - 1) / tile_size;
+    const int tiles_y = (frame.rows + tile_size - 1) / tile_size;
+    std::vector<int> tiles(tiles_x * tiles_y);
+    std::iota(tiles.begin(), tiles.end(), 0);
+    std::atomic<int> mixed(0);
+
+    std::for_each(std::execution::par, tiles.begin(), tiles.end(), [&](int t) {
+        cv::Rect rect = cv::Rect((t % tiles_x) * tile_size, (t / tiles_x) * tile_size, tile_size,
+                                 tile_size) &
+                        cv::Rect(0, 0, frame.cols, frame.rows);
+        const int bytes = rect.width * 3;
+
+        switch (sampler.classify(rect)) {
+            case MaskSampler::Coverage::Foreground:
+                break;
+
+            case MaskSampler::Coverage::Background:
+                for (int y = rect.y; y < rect.y + rect.height; y++)
+                    std::memcpy(frame.ptr<unsigned char>(y) + rect.x * 3,
+                                backgroundRow(y, rect.x), bytes);
+                break;
+
+            case MaskSampler::Coverage::Mixed:
+                mixed++;
+                for (int y = rect.y; y < rect.y + rect.height; y++) {
+                    unsigned char select[tile_size * 3];
+                    sampler.sampleRow(y, select, 3, rect.x, rect.x + rect.width);
+                    unsigned char *f = frame.ptr<unsigned char>(y) + rect.x * 3;
+                    const unsigned char *b = backgroundRow(y, rect.x);
+                    // Branchless byte select, vectorized by the compiler.
+                    for (int i = 0; i < bytes; i++)
+                        f[i] = (f[i] & ~select[i]) | (b[i] & select[i]);
+                }
+                break;
+        }
+    });
+
+    Metrics::get().setGauge("bgr_mixed_tiles_fraction", (double)mixed / tiles.size());
+}
+
+void compositeAlpha(cv::Mat &frame /* rgb */, const Background &background /* rgb */,
+                    const cv::Mat &alpha) {
+    CHECK_EQ(frame.type(), CV_8UC3);
+    CHECK_EQ(alpha.type(), CV_8U);
+    CHECK(frame.size() == alpha.size());
+    std::vector<unsigned char> solid_row;
+    auto backgroundRow = backgroundRows(frame, background, frame.cols, &solid_row);
+
+    parallelRows(frame.rows, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            unsigned char *f = frame.ptr<unsigned char>(y);
+            const unsigned char *b = backgroundRow(y, 0);
+            const unsigned char *a = alpha.ptr<unsigned char>(y);
+            for (int x = 0; x < frame.cols; x++) {
+                int w = a[x];
+                for (int c = 0; c < 3; c++)
+                    f[x * 3 + c] = (f[x * 3 + c] * (255 - w) + b[x * 3 + c] * w + 127) / 255;
+            }
+        }
+    });
+}
+
+// alphaRow(y, begin, end, row) writes the background alpha of columns [begin, end) of row y.
+template <typename F>
+static void packMatte(const cv::Mat &frame, F alphaRow, cv::Mat &out) {
+    CHECK_EQ(frame.type(), CV_8UC3);
+    out.create(frame.size(), CV_8UC4);
+
+    parallelRows(frame.rows, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            const unsigned char *f = frame.ptr<unsigned char>(y);
+            unsigned char *o = out.ptr<unsigned char>(y);
+            for (int x0 = 0; x0 < frame.cols; x0 += tile_size) {
+                const int x1 = std::min(x0 + tile_size, frame.cols);
+                unsigned char a[tile_size];
+                alphaRow(y, x0, x1, a);
+                for (int x = x0; x < x1; x++) {
+                    o[x * 4 + 0] = f[x * 3 + 2];
+                    o[x * 4 + 1] = f[x * 3 + 1];
+                    o[x * 4 + 2] = f[x * 3 + 0];
+                    o[x * 4 + 3] = ~a[x - x0];
+                }
+            }
+        }
+    });
+}
+
+void packMatte(const cv::Mat &frame /* rgb */, const BitMask &mask, cv::Mat &out /* bgra */) {
+    MaskSampler sampler(mask, frame.size());
+    packMatte(
+        frame,
+        [&](int y, int begin, int end, unsigned char *row) {
+            sampler.sampleRow(y, row, 1, begin, end);
+        },
+        out);
+}
+
+void packMatte(const cv::Mat &frame /* rgb */, const cv::Mat &alpha, cv::Mat &out /* bgra */) {
+    CHECK_EQ(alpha.type(), CV_8U);
+    CHECK(frame.size() == alpha.size());
+    packMatte(
+        frame,
+        [&](int y, int begin, int end, unsigned char *row) {
+            std::memcpy(row, alpha.ptr<unsigned char>(y) + begin, end - begin);
+        },
+        out);
+}
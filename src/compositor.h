@@ -0,0 +1,56 @@
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "background_selector.h"
+#include "bit_mask.h"
+
+// Bilinearly upsamples a low-res mask (set for background) one output row at a time, so the
+// full-res mask never has to be materialized.
+class MaskSampler {
+    cv::Mat mask_;  // the low-res mask expanded to CV_8U 0/1, small enough to stay in cache
+    const cv::Size size_;
+    std::vector<int> x0_, x1_, wx_;  // per output column; weights are 8 bit fixed point
+
+   public:
+    enum class Coverage {
+        Foreground,
+        Background,
+        Mixed,
+    };
+
+    MaskSampler(const BitMask &mask, cv::Size size);
+
+    // Writes columns [begin, end) of row y of the upsampled mask to row: 0xff where the
+    // background shows, 0 where the frame is kept, each value repeated channels times.
+    void sampleRow(int y, unsigned char *row, int channels = 1) const {
+        sampleRow(y, row, channels, 0, size_.width);
+    }
+    void sampleRow(int y, unsigned char *row, int channels, int begin, int end) const;
+
+    // Whether the upsampled mask is the same everywhere in rect, from the low-res pixels it is
+    // interpolated from.
+    Coverage classify(const cv::Rect &rect) const;
+};
+
+// Replaces the background pixels of frame according to the low-res mask. The frame is split
+// into tiles: pure foreground tiles are left alone, pure background tiles are copied from
+// background with memcpy, and only tiles on the mask's edge are upsampled and composited, in
+// the same pass over each row. A solid background is read from a single cached row instead of a
+// full frame.
+void compositeMask(cv::Mat &frame /* rgb */, const Background &background /* rgb */,
+                   const BitMask &mask);
+
+// frame = frame * (1 - alpha) + background * alpha, with a full-res CV_8U alpha in 0..255.
+void compositeAlpha(cv::Mat &frame /* rgb */, const Background &background /* rgb */,
+                    const cv::Mat &alpha);
+
+// Converts frame to BGR32 (b g r a in memory) in out, with alpha 0 where the mask is set, in a
+// single pass. out is reallocated only if its size or type don't match.
+void packMatte(const cv::Mat &frame /* rgb */, const BitMask &mask, cv::Mat &out /* bgra */);
+// Same, with a full-res CV_8U background alpha in 0..255, inverted into the alpha channel.
+void packMatte(const cv::Mat &frame /* rgb */, const cv::Mat &alpha, cv::Mat &out /* bgra */);
+
+#endif  // COMPOSITOR_H
@@ -0,0 +1,134 @@
+#include "edge_blender.h"
+
+#include <algorithm>
+#include <atomic>
+#include <execution>
+#include <numeric>
+#include <opencv2/imgproc.hpp>
+
+#include "compositor.h"
+#include "glog/logging.h"
+#include "metrics.h"
+
+constexpr int tile_size = 64;
+
+EdgeBlender::EdgeBlender(int radius, float light_wrap, float color_match)
+    : radius_(radius), light_wrap_(light_wrap), color_match_(color_match) {
+    CHECK_GT(radius_, 0);
+    CHECK(light_wrap_ >= 0 && light_wrap_ <= 1) << "light_wrap must be in [0, 1]";
+    CHECK(color_match_ >= 0 && color_match_ <= 1) << "color_match must be in [0, 1]";
+}
+
+void EdgeBlender::updateBackground(const Background &background, cv::Size size) {
+    if (background.generation == generation_) return;
+    generation_ = background.generation;
+
+    if (background.solid()) {
+        blurred_ = cv::Mat();
+        background_mean_ =
+            cv::Vec3f(background.pixel[0], background.pixel[1], background.pixel[2]);
+    } else {
+        CHECK(background.image.size() == size);
+        cv::blur(background.image, blurred_, cv::Size(2 * radius_ + 1, 2 * radius_ + 1));
+        cv::Scalar mean = cv::mean(background.image);
+        background_mean_ = cv::Vec3f(mean[0], mean[1], mean[2]);
+    }
+}
+
+// Estimated from one frame pixel per low-res foreground pixel, so the cost doesn't depend on
+// the frame size.
+cv::Vec3f EdgeBlender::foregroundMean(const cv::Mat &frame, const BitMask &mask) const {
+    cv::Vec3f sum(0, 0, 0);
+    int n = 0;
+    for (int y = 0; y < mask.height(); y++) {
+        const unsigned char *f =
+            frame.ptr<unsigned char>((int)((y + .5f) * frame.rows / mask.height()));
+        for (int x = 0; x < mask.width(); x++) {
+            if (mask.get(x, y)) continue;
+            const unsigned char *p = f + (int)((x + .5f) * frame.cols / mask.width()) * 3;
+            sum += cv::Vec3f(p[0], p[1], p[2]);
+            n++;
+        }
+    }
+    return n ? sum / n : background_mean_;
+}
+
+void EdgeBlender::apply(cv::Mat &frame /* rgb */, const Background &background /* rgb */,
+                        const BitMask &mask) {
+    CHECK_EQ(frame.type(), CV_8UC3);
+    updateBackground(background, frame.size());
+
+    // Per-channel gains that give the foreground the background's chromaticity while keeping
+    // its brightness, clamped so that only the color temperature shifts noticeably.
+    cv::Vec3f gain(1, 1, 1);
+    if (color_match_ > 0) {
+        const cv::Vec3f fg = foregroundMean(frame, mask), &bg = background_mean_;
+        const float fg_sum = fg[0] + fg[1] + fg[2], bg_sum = bg[0] + bg[1] + bg[2];
+        if (fg_sum >= 1 && bg_sum >= 1)
+            for (int c = 0; c < 3; c++)
+                gain[c] = std::clamp(bg[c] / bg_sum / (std::max(fg[c], 1.f) / fg_sum), .8f, 1.25f);
+    }
+
+    // Fraction of background around each low-res pixel, sampled bilinearly below. It is .5 on
+    // the edge and falls to 0 radius pixels into the foreground.
+    cv::Mat near;
+    mask.toMat().convertTo(near, CV_32F);
+    const int r = std::max(1, radius_ * mask.width() / frame.cols);
+    cv::blur(near, near, cv::Size(2 * r + 1, 2 * r + 1));
+    const float sx = (float)mask.width() / frame.cols, sy = (float)mask.height() / frame.rows;
+
+    MaskSampler sampler(mask, frame.size());
+    const int tiles_x = (frame.cols + tile_size - 1) / tile_size;
+    const int tiles_y = (frame.rows + tile_size - 1) / tile_size;
+    std::vector<int> tiles(tiles_x * tiles_y);
+    std::iota(tiles.begin(), tiles.end(), 0);
+    std::atomic<int> band(0);
+
+    std::for_each(std::execution::par, tiles.begin(), tiles.end(), [&](int t) {
+        const cv::Rect bounds(0, 0, frame.cols, frame.rows);
+        const cv::Rect rect = cv::Rect((t % tiles_x) * tile_size, (t / tiles_x) * tile_size,
+                                       tile_size, tile_size) &
+                              bounds;
+        const cv::Rect grown = cv::Rect(rect.x - radius_, rect.y - radius_,
+                                        rect.width + 2 * radius_, rect.height + 2 * radius_) &
+                               bounds;
+        if (sampler.classify(grown) != MaskSampler::Coverage::Mixed) return;
+        band++;
+
+        for (int y = rect.y; y < rect.y + rect.height; y++) {
+            unsigned char select[tile_size];
+            sampler.sampleRow(y, select, 1, rect.x, rect.x + rect.width);
+
+            const float fy = std::max(0.f, (y + .5f) * sy - .5f);
+            const int y0 = std::min((int)fy, near.rows - 1), y1 = std::min(y0 + 1, near.rows - 1);
+            const float wy = fy - y0;
+            const float *n0 = near.ptr<float>(y0), *n1 = near.ptr<float>(y1);
+
+            unsigned char *f = frame.ptr<unsigned char>(y) + rect.x * 3;
+            const unsigned char *b = blurred_.empty() ? background.pixel.data()
+                                                      : blurred_.ptr<unsigned char>(y) + rect.x * 3;
+            const int b_step = blurred_.empty() ? 0 : 3;
+
+            for (int i = 0; i < rect.width; i++, f += 3, b += b_step) {
+                if (select[i]) continue;  // already background
+
+                const float fx = std::max(0.f, (rect.x + i + .5f) * sx - .5f);
+                const int x0 = std::min((int)fx, near.cols - 1),
+                          x1 = std::min(x0 + 1, near.cols - 1);
+                const float wx = fx - x0;
+                const float w =
+                    std::min(1.f, 2 * ((n0[x0] * (1 - wx) + n0[x1] * wx) * (1 - wy) +
+                                       (n1[x0] * (1 - wx) + n1[x1] * wx) * wy));
+                if (w <= 0) continue;
+
+                for (int c = 0; c < 3; c++) {
+                    float v = f[c] * (1 + color_match_ * w * (gain[c] - 1));
+                    v += light_wrap_ * w * (b[c] - v);
+                    f[c] = cv::saturate_cast<unsigned char>(v);
+                }
+            }
+        }
+    });
+
+    Metrics::get().setGauge("bgr_edge_band_tiles_fraction", (double)band / tiles.size());
+}
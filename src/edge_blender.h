@@ -0,0 +1,34 @@
+#ifndef EDGE_BLENDER_H
+#define EDGE_BLENDER_H
+
+#include <opencv2/core.hpp>
+
+#include "background_selector.h"
+#include "bit_mask.h"
+
+// Softens a composited frame along the mask's edge: light wrap blends the blurred background
+// into the foreground near the edge, and color matching pulls the foreground there towards the
+// background's mean color. Only tiles within radius of the edge are touched, so the cost scales
+// with the perimeter of the mask, not with the frame size.
+class EdgeBlender {
+    const int radius_;          // width of the edge band, in frame pixels
+    const float light_wrap_;    // 0..1, weight of the blurred background right at the edge
+    const float color_match_;   // 0..1, how far the foreground's color is moved at the edge
+
+    // Per background, recomputed when the background's generation changes.
+    uint64_t generation_ = 0;
+    cv::Mat blurred_;           // rgb, empty for a solid background
+    cv::Vec3f background_mean_;
+
+    void updateBackground(const Background &background, cv::Size size);
+    cv::Vec3f foregroundMean(const cv::Mat &frame, const BitMask &mask) const;
+
+   public:
+    EdgeBlender(int radius, float light_wrap, float color_match);
+
+    // frame has already been composited onto background with mask (set for background).
+    void apply(cv::Mat &frame /* rgb */, const Background &background /* rgb */,
+               const BitMask &mask);
+};
+
+#endif  // EDGE_BLENDER_H
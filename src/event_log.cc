@@ -0,0 +1,115 @@
+#include "event_log.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "glog/logging.h"
+#include "trace.h"
+
+EventLog::EventLog() {
+    for (size_t i = 0; i < capacity; i++) slots_[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+EventLog &EventLog::get() {
+    static EventLog log;
+    return log;
+}
+
+EventLog::~EventLog() {
+    if (!thread_.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void EventLog::start(std::chrono::seconds interval) {
+    CHECK(!thread_.joinable()) << "EventLog already started";
+    CHECK_GT(interval.count(), 0);
+    thread_ = std::thread(&EventLog::run, this, interval);
+}
+
+void EventLog::record(const char *name, double value) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (1) {
+        Slot &slot = slots_[pos % capacity];
+        const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.event = {name, value};
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return;
+            }
+        } else if (diff < 0) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);  // full
+            return;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// Only called from the summary thread.
+bool EventLog::pop(Event &event) {
+    Slot &slot = slots_[dequeue_pos_ % capacity];
+    const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if ((intptr_t)sequence - (intptr_t)(dequeue_pos_ + 1) < 0) return false;
+    event = slot.event;
+    slot.sequence.store(dequeue_pos_ + capacity, std::memory_order_release);
+    dequeue_pos_++;
+    return true;
+}
+
+void EventLog::run(std::chrono::seconds interval) {
+    setThreadName("log");
+    struct Summary {
+        unsigned long count = 0;
+        double sum = 0;
+        double min = std::numeric_limits<double>::max();
+        double max = std::numeric_limits<double>::lowest();
+    };
+    std::map<std::string, Summary> summaries;
+    auto last_summary = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        // Drain at least every second, so the queue doesn't fill up with long intervals.
+        cv_.wait_for(lock, std::min<std::chrono::seconds>(interval, std::chrono::seconds(1)),
+                     [this] { return stopping_; });
+
+        for (Event e; pop(e);) {
+            Summary &s = summaries[e.name];
+            s.count++;
+            s.sum += e.value;
+            s.min = std::min(s.min, e.value);
+            s.max = std::max(s.max, e.value);
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now - last_summary < interval) continue;
+        const double seconds = std::chrono::duration<double>(now - last_summary).count();
+        last_summary = now;
+        const unsigned long dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (summaries.empty() && !dropped) continue;
+
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(1) << "Last " << seconds << "s:";
+        const char *separator = " ";
+        for (const auto &[name, s] : summaries) {
+            line << separator << name << " n=" << s.count << " " << s.count / seconds << "/s"
+                 << " mean=" << s.sum / s.count << " min=" << s.min << " max=" << s.max;
+            separator = ", ";
+        }
+        if (dropped) line << separator << dropped << " events dropped";
+        LOG(INFO) << line.str();
+        summaries.clear();
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+
+// Logging for things that happen every frame. record() only puts a (name, value) pair into a
+// bounded lock-free queue, without formatting or I/O, and drops it if the queue is full. A
+// thread of its own drains the queue and logs one summary line per interval, with each name's
+// count, rate, mean, min and max, e.g.
+//
+//     Last 10s: inference_ms n=600 60.0/s mean=12.3 min=9.1 max=30.2, ...
+class EventLog {
+    struct Event {
+        const char *name;  // a string literal
+        double value;
+    };
+    struct Slot {
+        std::atomic<size_t> sequence;
+        Event event;
+    };
+    static constexpr size_t capacity = 4096;
+
+    // A bounded multi-producer queue, after Dmitry Vyukov's: a slot whose sequence equals the
+    // enqueue position is free, one whose sequence is position + 1 holds an event.
+    Slot slots_[capacity];
+    std::atomic<size_t> enqueue_pos_{0};
+    size_t dequeue_pos_ = 0;
+    std::atomic<unsigned long> dropped_{0};
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+
+    EventLog();
+    bool pop(Event &event);
+    void run(std::chrono::seconds interval);
+
+   public:
+    static EventLog &get();
+    ~EventLog();
+
+    // Starts logging summaries every interval. Events recorded before are kept, up to the
+    // queue's capacity.
+    void start(std::chrono::seconds interval);
+
+    // Thread-safe and lock-free. name must be a string literal.
+    void record(const char *name, double value = 1);
+};
+
+#endif  // EVENT_LOG_H
@@ -0,0 +1,239 @@
+#include "fd_sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <linux/videodev2.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "color_convert.h"
+#include "event_log.h"
+#include "glog/logging.h"
+#include "metrics.h"
+#include "pixel_format.h"
+#include "trace.h"
+
+FdSink::FdSink(int fd, int width, int height, uint32_t pixelformat, DropPolicy policy,
+               bool frame_per_write)
+    : width_(width),
+      height_(height),
+      bpp_(bytesPerPixel(pixelformat)),
+      pixelformat_(pixelformat),
+      policy_(policy),
+      frame_per_write_(frame_per_write),
+      black_(width * bpp_),
+      fd_(fd) {
+    CHECK(bpp_ > 0) << "Can't determine bytes per pixel for format " << pixelformat;
+    const unsigned char black[6] = {};
+    for (int x = 0; x < width; x += 2)
+        convertRgbPixels(black, std::min(2, width - x), pixelformat, black_.data() + x * bpp_);
+    if (policy_ == DropPolicy::Block) return;
+
+    int flags = fcntl(fd_, F_GETFL);
+    PCHECK(flags != -1 && fcntl(fd_, F_SETFL, flags | O_NONBLOCK) != -1)
+        << "Can't make the output non-blocking";
+    thread_ = std::thread(&FdSink::run, this);
+}
+
+FdSink::~FdSink() {
+    if (thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+    }
+    close(fd_);
+}
+
+// The previous slot may still be queued, so every frame gets a fresh one.
+cv::Mat FdSink::beginFrame() {
+    slot_ = cv::Mat(height_, width_, CV_8UC(bpp_));
+    return slot_;
+}
+
+void FdSink::commitFrame(int64_t timestamp_ns) {
+    writeFrame(slot_, timestamp_ns);
+    slot_ = cv::Mat();
+}
+
+// The frame's rows centered on black, with adjacent spans merged, so that a continuous frame of
+// the sink's size is a single span.
+std::vector<struct iovec> FdSink::rowSpans(const cv::Mat &frame) const {
+    std::vector<struct iovec> spans;
+    auto add = [&spans](const unsigned char *p, size_t n) {
+        if (!n) return;
+        if (!spans.empty() &&
+            static_cast<unsigned char *>(spans.back().iov_base) + spans.back().iov_len == p)
+            spans.back().iov_len += n;
+        else
+            spans.push_back({const_cast<unsigned char *>(p), n});
+    };
+
+    const int top = (height_ - frame.rows) / 2;
+    const int left = (width_ - frame.cols) / 2 & ~1;  // whole YUYV/UYVY pixel pairs
+    const size_t row = (size_t)width_ * bpp_, cols = (size_t)frame.cols * bpp_;
+    for (int y = 0; y < top; y++) add(black_.data(), row);
+    for (int y = 0; y < frame.rows; y++) {
+        add(black_.data(), left * bpp_);
+        add(frame.ptr<unsigned char>(y), cols);
+        add(black_.data(), row - left * bpp_ - cols);
+    }
+    for (int y = top + frame.rows; y < height_; y++) add(black_.data(), row);
+    return spans;
+}
+
+// Returns false if nothing could be written because the fd wasn't ready (only in non-blocking
+// mode). Once the reader is gone, frames are discarded as if written.
+bool FdSink::write(const cv::Mat &frame) {
+    TraceSpan span("fd_write");
+    if (broken_) return true;
+    const size_t total = (size_t)width_ * height_ * bpp_;
+    std::vector<struct iovec> spans = rowSpans(frame);
+
+    // The v4l2 core has no write_iter, so the kernel would pass each span to the loopback as a
+    // write() of its own, i.e. as a frame. Gather the spans there instead.
+    cv::Mat gathered;
+    if (frame_per_write_ && spans.size() > 1) {
+        gathered.create(height_, width_, CV_8UC(bpp_));
+        unsigned char *p = gathered.data;
+        for (const auto &span : spans)
+            p = std::copy_n(static_cast<unsigned char *>(span.iov_base), span.iov_len, p);
+        spans = {{gathered.data, total}};
+    }
+
+    size_t done = 0;
+    for (size_t i = 0; i < spans.size();) {
+        ssize_t ret = writev(fd_, &spans[i], std::min<size_t>(spans.size() - i, IOV_MAX));
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!done) return false;
+            // Finish the frame, a stream can't skip the rest of it.
+            struct pollfd pfd = {fd_, POLLOUT, 0};
+            PCHECK(poll(&pfd, 1, -1) >= 0) << "poll() failed";
+            continue;
+        }
+        if (ret < 0 && errno == EPIPE) {
+            // The reader of a FIFO or pipe went away. Give up on this sink, the other outputs
+            // keep going.
+            Metrics::get().addCounter("bgr_output_errors_total");
+            LOG(ERROR) << "Output's reader went away, disabling it";
+            broken_ = true;
+            return true;
+        }
+        PCHECK(ret > 0) << "Can't write " << total - done << " bytes to the output";
+        done += ret;
+
+        // The loopback takes every write() as a frame, so the rest can't be written separately.
+        if (done < total && frame_per_write_) {
+            Metrics::get().addCounter("bgr_output_partial_frames_total");
+            EventLog::get().record("output_write_truncated", done);
+            return true;
+        }
+
+        // Skip the spans that were written completely, and the written part of the next one.
+        for (; i < spans.size() && (size_t)ret >= spans[i].iov_len; i++) ret -= spans[i].iov_len;
+        if (ret) {
+            spans[i].iov_base = static_cast<unsigned char *>(spans[i].iov_base) + ret;
+            spans[i].iov_len -= ret;
+        }
+    }
+
+    EventLog::get().record("output_frame_bytes", total);
+    return true;
+}
+
+void FdSink::writeFrame(const cv::Mat &frame, int64_t timestamp_ns) {
+    CHECK_LE(frame.cols, width_);
+    CHECK_LE(frame.rows, height_);
+    CHECK_EQ(frame.elemSize(), bpp_);
+    CHECK((pixelformat_ != V4L2_PIX_FMT_YUYV && pixelformat_ != V4L2_PIX_FMT_UYVY) ||
+          frame.cols % 2 == 0)
+        << "YUYV and UYVY need an even width";
+    if (broken_) return;
+
+    if (policy_ == DropPolicy::Block) {
+        write(frame);
+        delivered(timestamp_ns);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        if (last_queued_.time_since_epoch().count())
+            frame_interval_ = frame_interval_.count() ? .9 * frame_interval_ +
+                                                            .1 * (now - last_queued_)
+                                                      : now - last_queued_;
+        last_queued_ = now;
+
+        if (!queued_.empty()) {
+            Metrics::get().addCounter("bgr_output_dropped_frames_total");
+            if (policy_ == DropPolicy::DropNewest) return;
+        }
+        queued_ = frame;
+        queued_timestamp_ = timestamp_ns;
+    }
+    cv_.notify_one();
+}
+
+void FdSink::run() {
+    setThreadName("sink-fd" + std::to_string(fd_));
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        bool repeat = false;
+        if (queued_.empty()) {
+            if (policy_ == DropPolicy::RepeatLast && !last_.empty() && frame_interval_.count()) {
+                repeat = !cv_.wait_for(lock, 1.5 * frame_interval_,
+                                       [this] { return stopping_ || !queued_.empty(); });
+            } else {
+                cv_.wait(lock, [this] { return stopping_ || !queued_.empty(); });
+            }
+            if (stopping_) break;
+        }
+
+        // Wait for the consumer without holding the lock, so writeFrame() never blocks, and
+        // with a timeout, so that stopping_ is noticed.
+        lock.unlock();
+        struct pollfd pfd = {fd_, POLLOUT, 0};
+        int ready = poll(&pfd, 1, 100);
+        PCHECK(ready >= 0) << "poll() failed";
+        lock.lock();
+        if (!ready) continue;
+
+        // A frame queued while polling supersedes the repeat.
+        cv::Mat frame = queued_.empty() ? (repeat ? last_ : cv::Mat()) : queued_;
+        if (frame.empty()) continue;
+        lock.unlock();
+        bool written = write(frame);
+        lock.lock();
+        if (!written) continue;  // stays queued unless replaced meanwhile
+
+        // Repeats aren't counted as deliveries, only the frame's first write is.
+        if (queued_.data == frame.data) {
+            queued_ = cv::Mat();
+            delivered(queued_timestamp_);
+        }
+        if (repeat && frame.data == last_.data)
+            Metrics::get().addCounter("bgr_output_repeated_frames_total");
+        last_ = frame;
+    }
+}
+
+static int openFile(const std::string &path) {
+    // A reader going away should fail the write() with EPIPE, not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    PCHECK(fd >= 0) << "Can't open " << path;
+    LOG(INFO) << "Writing raw frames to " << path;
+    return fd;
+}
+
+FileSink::FileSink(const std::string &path, int width, int height, uint32_t pixelformat,
+                   DropPolicy policy)
+    : FdSink(openFile(path), width, height, pixelformat, policy, false) {}
@@ -0,0 +1,75 @@
+#ifndef FD_SINK_H
+#define FD_SINK_H
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "output_sink.h"
+
+// Writes frames to a file descriptor. Except with DropPolicy::Block, the descriptor is made
+// non-blocking and written by a thread of its own that polls it, so writeFrame() never waits
+// for the consumer; at most one frame is queued.
+//
+// writeFrame() also takes non-continuous frames (e.g. ROIs) and frames smaller than the sink,
+// which are centered on black. For byte-stream sinks (files, FIFOs) their rows and the borders
+// are gathered with writev() straight from where they are, without a contiguous copy. v4l2
+// sinks still need one: the loopback takes every write() as a frame, and the v4l2 core passes
+// each iovec of a writev() on as a write() of its own.
+class FdSink : public OutputSink {
+    const int width_, height_, bpp_;
+    const uint32_t pixelformat_;
+    const DropPolicy policy_;
+    // Whether each write() is taken as a whole frame (v4l2), or the fd is a byte stream whose
+    // short writes have to be completed.
+    const bool frame_per_write_;
+    std::vector<unsigned char> black_;  // a row of black pixels, for borders
+    cv::Mat slot_;
+    std::atomic<bool> broken_{false};  // set once the reader went away, frames are discarded
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    cv::Mat queued_;  // empty if there is none
+    int64_t queued_timestamp_ = 0;
+    cv::Mat last_;  // last frame written, for RepeatLast
+    std::chrono::steady_clock::time_point last_queued_;
+    std::chrono::duration<double> frame_interval_{0};  // moving average between writeFrame()s
+    bool stopping_ = false;
+
+    std::vector<struct iovec> rowSpans(const cv::Mat &frame) const;
+    bool write(const cv::Mat &frame);
+    void run();
+
+   protected:
+    const int fd_;
+
+    // Takes ownership of fd.
+    FdSink(int fd, int width, int height, uint32_t pixelformat, DropPolicy policy,
+           bool frame_per_write);
+
+   public:
+    ~FdSink() override;
+    FdSink(const FdSink &) = delete;
+    FdSink &operator=(const FdSink &) = delete;
+
+    cv::Mat beginFrame() override;
+    void commitFrame(int64_t timestamp_ns) override;
+    void writeFrame(const cv::Mat &frame, int64_t timestamp_ns) override;
+};
+
+// Raw frames to a file or FIFO. Opening a FIFO waits for its reader.
+class FileSink : public FdSink {
+   public:
+    FileSink(const std::string &path, int width, int height, uint32_t pixelformat,
+             DropPolicy policy);
+};
+
+#endif  // FD_SINK_H
@@ -0,0 +1,107 @@
+#include "frame_pacer.h"
+
+#include <errno.h>
+#include <time.h>
+
+#include <cmath>
+
+#include "glog/logging.h"
+#include "metrics.h"
+#include "timestamp.h"
+#include "trace.h"
+
+FramePacer::FramePacer(OutputFanout &outputs, double fps) : outputs_(outputs), fps_(fps) {
+    CHECK_GE(fps_, 0);
+    thread_ = std::thread(&FramePacer::run, this);
+}
+
+FramePacer::~FramePacer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void FramePacer::writeFrame(const cv::Mat &frame, int64_t timestamp_ns) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (last_capture_ns_ && timestamp_ns > last_capture_ns_) {
+            const double interval = timestamp_ns - last_capture_ns_;
+            capture_interval_ns_ =
+                capture_interval_ns_ ? .9 * capture_interval_ns_ + .1 * interval : interval;
+        }
+        last_capture_ns_ = timestamp_ns;
+
+        if (!pending_.empty()) Metrics::get().addCounter("bgr_pacer_skipped_frames_total");
+        pending_ = frame;
+        pending_timestamp_ = timestamp_ns;
+    }
+    cv_.notify_one();
+}
+
+static void sleepUntil(int64_t deadline_ns) {
+    struct timespec ts = {static_cast<time_t>(deadline_ns / 1000000000),
+                          static_cast<long>(deadline_ns % 1000000000)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+    }
+}
+
+void FramePacer::run() {
+    setThreadName("pacer");
+    cv::Mat last;
+    int64_t deadline = 0, last_written = 0;
+    double deviation = 0;  // moving average of |write interval - cadence|, in ns
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (1) {
+        // Until there is a frame to repeat and a cadence, frames are written as they come.
+        const double interval = fps_ > 0 ? 1e9 / fps_ : capture_interval_ns_;
+        if (last.empty() || !interval) {
+            cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+            if (stopping_) return;
+            cv::Mat frame = last = pending_;
+            int64_t timestamp_ns = pending_timestamp_;
+            pending_ = cv::Mat();
+            lock.unlock();
+            outputs_.writeFrame(frame, timestamp_ns);
+            deadline = last_written = monotonicNs();
+            lock.lock();
+            continue;
+        }
+
+        deadline += interval;
+        const int64_t now = monotonicNs();
+        if (now > deadline + interval) {
+            const int64_t missed = (now - deadline) / interval;
+            Metrics::get().addCounter("bgr_pacer_missed_ticks_total", missed);
+            deadline += missed * interval;
+        }
+
+        lock.unlock();
+        sleepUntil(deadline);
+        Metrics::get().observe("bgr_pacer_lateness_seconds", (monotonicNs() - deadline) / 1e9);
+        lock.lock();
+        if (stopping_) return;
+
+        // Repeats pass no timestamp, they aren't deliveries of a new frame.
+        cv::Mat frame = last;
+        int64_t timestamp_ns = 0;
+        if (!pending_.empty()) {
+            frame = last = pending_;
+            timestamp_ns = pending_timestamp_;
+            pending_ = cv::Mat();
+        } else {
+            Metrics::get().addCounter("bgr_pacer_repeated_frames_total");
+        }
+        lock.unlock();
+        outputs_.writeFrame(frame, timestamp_ns);
+
+        const int64_t written = monotonicNs();
+        deviation = .9 * deviation + .1 * std::abs(written - last_written - interval);
+        last_written = written;
+        Metrics::get().setGauge("bgr_pacer_interval_jitter_seconds", deviation / 1e9);
+        lock.lock();
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <thread>
+
+#include "output_fanout.h"
+
+// Writes frames to the outputs on a steady cadence instead of as soon as they are ready, so
+// that jitter in inference time doesn't reach the consumers as jitter in frame intervals. A
+// thread of its own sleeps until absolute deadlines (clock_nanosleep with TIMER_ABSTIME, so
+// errors don't accumulate) and writes the newest frame at each; frames superseded before
+// their tick are skipped and ticks without a new frame repeat the last one. Ticks missed
+// because writing took too long are dropped rather than made up in a burst.
+//
+// Exports the deadline lateness as a histogram, the mean deviation of the actual write
+// intervals from the cadence as a gauge, and skipped, repeated and missed counts.
+class FramePacer {
+    OutputFanout &outputs_;
+    const double fps_;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    cv::Mat pending_;  // empty if there is none
+    int64_t pending_timestamp_ = 0;
+    int64_t last_capture_ns_ = 0;
+    double capture_interval_ns_ = 0;  // moving average of the capture timestamps' intervals
+    bool stopping_ = false;
+
+    void run();
+
+   public:
+    // fps 0 follows the capture rate, as estimated from the frames' timestamps.
+    FramePacer(OutputFanout &outputs, double fps);
+    ~FramePacer();
+    FramePacer(const FramePacer &) = delete;
+    FramePacer &operator=(const FramePacer &) = delete;
+
+    // Like OutputFanout::writeFrame(), but returns right away.
+    void writeFrame(const cv::Mat &frame, int64_t timestamp_ns);
+};
+
+#endif  // FRAME_PACER_H
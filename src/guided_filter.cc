@@ -0,0 +1,137 @@
+#include "guided_filter.h"
+
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+#include <vector>
+
+#include "glog/logging.h"
+#include "parallel.h"
+
+// Mean over a (2r+1)x(2r+1) window, clipped at the borders, in O(1) per pixel: a running sum
+// down the columns (vectorized across the row) followed by a running sum along each row.
+static cv::Mat boxFilter(const cv::Mat &src, int r) {
+    CHECK_EQ(src.type(), CV_32F);
+    const int w = src.cols, h = src.rows;
+    cv::Mat vert(src.size(), CV_32F), ret(src.size(), CV_32F);
+
+    parallelRows(h, [&](int begin, int end) {
+        std::vector<float> sum(w, 0.f);
+        // Rows begin-r-1 .. begin+r-1, so the first iteration ends up with the right window.
+        for (int y = std::max(0, begin - r - 1); y < std::min(h, begin + r); y++) {
+            const float *s = src.ptr<float>(y);
+            for (int x = 0; x < w; x++) sum[x] += s[x];
+        }
+        for (int y = begin; y < end; y++) {
+            if (y + r < h) {
+                const float *add = src.ptr<float>(y + r);
+                for (int x = 0; x < w; x++) sum[x] += add[x];
+            }
+            if (y - r - 1 >= 0) {
+                const float *sub = src.ptr<float>(y - r - 1);
+                for (int x = 0; x < w; x++) sum[x] -= sub[x];
+            }
+            const float n = std::min(h - 1, y + r) - std::max(0, y - r) + 1;
+            float *v = vert.ptr<float>(y);
+            for (int x = 0; x < w; x++) v[x] = sum[x] / n;
+        }
+    });
+
+    parallelRows(h, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            const float *v = vert.ptr<float>(y);
+            float *d = ret.ptr<float>(y);
+            float sum = 0;
+            for (int x = 0; x < std::min(w, r); x++) sum += v[x];
+            for (int x = 0; x < w; x++) {
+                if (x + r < w) sum += v[x + r];
+                if (x - r - 1 >= 0) sum -= v[x - r - 1];
+                d[x] = sum / (std::min(w - 1, x + r) - std::max(0, x - r) + 1);
+            }
+        }
+    });
+
+    return ret;
+}
+
+GuidedFilter::GuidedFilter(int radius, float eps, int scale)
+    : radius_(radius), eps_(eps), scale_(scale) {
+    CHECK_GT(radius_, 0);
+    CHECK_GT(scale_, 0);
+}
+
+cv::Mat GuidedFilter::upsample(const cv::Mat &guide, const cv::Mat &mask) const {
+    CHECK_EQ(guide.type(), CV_8UC3);
+    CHECK_EQ(mask.type(), CV_8U);
+
+    // The coefficients are smooth, so they are computed on a subsampled gray guide.
+    cv::Size small(std::max(1, guide.cols / scale_), std::max(1, guide.rows / scale_));
+    cv::Mat gray, I, p;
+    cv::resize(guide, gray, small, 0, 0, cv::INTER_AREA);
+    cv::cvtColor(gray, gray, cv::COLOR_RGB2GRAY);
+    gray.convertTo(I, CV_32F, 1. / 255);
+    cv::resize(mask, p, small, 0, 0, cv::INTER_LINEAR);
+    p.convertTo(p, CV_32F);
+
+    cv::Mat Ip(small, CV_32F), II(small, CV_32F);
+    for (int y = 0; y < small.height; y++) {
+        const float *i = I.ptr<float>(y), *m = p.ptr<float>(y);
+        float *ip = Ip.ptr<float>(y), *ii = II.ptr<float>(y);
+        for (int x = 0; x < small.width; x++) {
+            ip[x] = i[x] * m[x];
+            ii[x] = i[x] * i[x];
+        }
+    }
+
+    cv::Mat mean_I = boxFilter(I, radius_), mean_p = boxFilter(p, radius_);
+    cv::Mat mean_Ip = boxFilter(Ip, radius_), mean_II = boxFilter(II, radius_);
+
+    // Per-pixel linear model q = a * I + b. a and b reuse the buffers of Ip and II.
+    cv::Mat &a = Ip, &b = II;
+    for (int y = 0; y < small.height; y++) {
+        const float *mi = mean_I.ptr<float>(y), *mp = mean_p.ptr<float>(y);
+        const float *mip = mean_Ip.ptr<float>(y), *mii = mean_II.ptr<float>(y);
+        float *ay = a.ptr<float>(y), *by = b.ptr<float>(y);
+        for (int x = 0; x < small.width; x++) {
+            float var = mii[x] - mi[x] * mi[x];
+            float cov = mip[x] - mi[x] * mp[x];
+            ay[x] = cov / (var + eps_);
+            by[x] = mp[x] - ay[x] * mi[x];
+        }
+    }
+    cv::Mat mean_a = boxFilter(a, radius_), mean_b = boxFilter(b, radius_);
+
+    // Apply the bilinearly upsampled coefficients to the full-res guide in a single pass.
+    const float sx = (float)small.width / guide.cols, sy = (float)small.height / guide.rows;
+    std::vector<int> x0(guide.cols), x1(guide.cols);
+    std::vector<float> wx(guide.cols);
+    for (int x = 0; x < guide.cols; x++) {
+        float fx = std::max(0.f, (x + .5f) * sx - .5f);
+        x0[x] = std::min((int)fx, small.width - 1);
+        x1[x] = std::min(x0[x] + 1, small.width - 1);
+        wx[x] = fx - x0[x];
+    }
+
+    cv::Mat ret(guide.size(), CV_8U);
+    parallelRows(guide.rows, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            float fy = std::max(0.f, (y + .5f) * sy - .5f);
+            int y0 = std::min((int)fy, small.height - 1), y1 = std::min(y0 + 1, small.height - 1);
+            float wy = fy - y0;
+            const float *a0 = mean_a.ptr<float>(y0), *a1 = mean_a.ptr<float>(y1);
+            const float *b0 = mean_b.ptr<float>(y0), *b1 = mean_b.ptr<float>(y1);
+            const cv::Vec3b *g = guide.ptr<cv::Vec3b>(y);
+            unsigned char *q = ret.ptr<unsigned char>(y);
+            for (int x = 0; x < guide.cols; x++) {
+                float at = a0[x0[x]] + (a0[x1[x]] - a0[x0[x]]) * wx[x];
+                float ab = a1[x0[x]] + (a1[x1[x]] - a1[x0[x]]) * wx[x];
+                float bt = b0[x0[x]] + (b0[x1[x]] - b0[x0[x]]) * wx[x];
+                float bb = b1[x0[x]] + (b1[x1[x]] - b1[x0[x]]) * wx[x];
+                float i = (.299f * g[x][0] + .587f * g[x][1] + .114f * g[x][2]) * (1.f / 255);
+                float v = (at + (ab - at) * wy) * i + bt + (bb - bt) * wy;
+                q[x] = std::clamp(v, 0.f, 1.f) * 255 + .5f;
+            }
+        }
+    });
+
+    return ret;
+}
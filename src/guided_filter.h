@@ -0,0 +1,21 @@
+#ifndef GUIDED_FILTER_H
+#define GUIDED_FILTER_H
+
+#include <opencv2/core.hpp>
+
+// Fast guided filter (He and Sun, "Fast Guided Filter", 2015) for upsampling a low-res mask so
+// that its edges follow the edges of the full-res frame.
+class GuidedFilter {
+    const int radius_;  // of the box filter, in pixels at the working resolution
+    const float eps_;   // regularization, larger values give smoother edges
+    const int scale_;   // the filter coefficients are computed at 1/scale of the guide size
+
+   public:
+    GuidedFilter(int radius, float eps, int scale = 4);
+
+    // guide is CV_8UC3, mask is CV_8U with values 0/1 and any size. Returns a CV_8U alpha
+    // (0..255) the size of guide.
+    cv::Mat upsample(const cv::Mat &guide, const cv::Mat &mask) const;
+};
+
+#endif  // GUIDED_FILTER_H
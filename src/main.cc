@@ -1,62 +1,186 @@
+#include <signal.h>
+
+#include <chrono>
+#include <deque>
+#include <future>
 #include <opencv2/highgui.hpp>
-#include <opencv2/imgproc.hpp>
 #include <opencv2/videoio.hpp>
 
 #include "background_remover.h"
 #include "background_selector.h"
+#include "color_convert.h"
+#include "event_log.h"
+#include "frame_pacer.h"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
-#include "video_writer.h"
+#include "mask_exporter.h"
+#include "metrics.h"
+#include "model_selector.h"
+#include "output_fanout.h"
+#include "output_sink.h"
+#include "pixel_format.h"
+#include "timestamp.h"
+#include "trace.h"
+#include "video_reader.h"
 
 DEFINE_string(model_filename, "deeplabv3_257_mv_gpu.tflite", "Model filename");
 DEFINE_string(model_type, "deeplabv3", "Model type [deeplabv3|bodypix_resnet|bodypix_mobilenet]");
+DEFINE_string(model_list, "",
+              "Comma-separated list of additional type:filename models to switch to at runtime "
+              "with m/M or SIGHUP");
+DEFINE_int32(num_threads, 4, "Total number of inference threads");
+DEFINE_int32(num_interpreters, 1,
+             "Number of interpreters running inference on consecutive frames in parallel");
+DEFINE_int32(num_warmup_runs, 2, "Number of dummy inferences per interpreter at startup");
+DEFINE_string(foreground_classes, "person",
+              "Comma-separated list of deeplabv3 classes to keep, e.g. person,chair,tv");
+DEFINE_string(excluded_parts, "",
+              "Comma-separated list of bodypix parts to remove, e.g. left_hand,right_hand");
+DEFINE_int32(refine_radius, 0,
+             "Radius of the guided filter snapping the mask to the frame's edges, 0 to disable");
+DEFINE_double(refine_eps, 1e-3, "Guided filter regularization, larger values blur the edges");
+DEFINE_int32(morph_radius, 0, "Radius of the opening/closing applied to the low-res mask");
+DEFINE_int32(min_component_size, 0, "Remove islands and holes smaller than this from the mask");
+DEFINE_double(temporal_alpha, 1,
+              "Weight of the newest mask in the per-pixel moving average, 1 disables smoothing");
+DEFINE_double(hysteresis, .2, "Distance from .5 the average has to cross to flip a pixel");
+DEFINE_double(light_wrap, 0, "Weight of the blurred background wrapped around the edge, 0..1");
+DEFINE_double(color_match, 0,
+              "How far the foreground's color is moved towards the background's near the edge, "
+              "0..1");
+DEFINE_int32(blend_radius, 16, "Width in pixels of the edge band for light_wrap and color_match");
+DEFINE_int32(inference_interval, 1, "Run inference on every n-th frame, reuse the mask otherwise");
 
 // This is an int, because cv::VideoCapture(int) gives a higher resolution than
 // cv::VideoCapture(const std::string&) (640x480, maybe b/c of an implicit
 // gstreamer pipeline?). XXX: Fix this.
 DEFINE_int32(input_device_number, 0, "Input device number (/dev/videoX)");
+DEFINE_string(input_format, "",
+              "If set, capture with v4l2 directly in this format [mjpeg|yuyv|uyvy|nv12|i420|...] "
+              "instead of through OpenCV");
+DEFINE_int32(input_width, 1280, "Capture width with --input_format");
+DEFINE_int32(input_height, 720, "Capture height with --input_format");
 
 DEFINE_string(output_device_path, "/dev/video2", "Output device");
+DEFINE_string(output, "",
+              "Comma-separated list of outputs, each v4l2:/dev/videoN, file:path (also FIFOs), "
+              "shm:name or null, optionally followed by @WIDTHxHEIGHT and @format (yuyv, uyvy, "
+              "rgb24, bgr24, rgb32, bgr32). Defaults to v4l2:<output_device_path>");
+DEFINE_string(color_matrix, "bt601", "YUV matrix of the outputs [bt601|bt709]");
+DEFINE_string(output_drop_policy, "block",
+              "What to do with frames the output can't take right away "
+              "[block|drop_newest|drop_oldest|repeat_last]");
+DEFINE_bool(pace_output, false,
+            "Write frames on a steady cadence instead of as soon as they are ready, repeating "
+            "or skipping frames to keep it");
+DEFINE_double(output_fps, 0, "Cadence of --pace_output, 0 to follow the capture rate");
+DEFINE_string(mask_output, "",
+              "If set, also publish the mask as GREY frames to this sink, given like --output");
+DEFINE_bool(output_alpha, false,
+            "Write the foreground as BGR32 with the mask in the alpha channel, instead of "
+            "compositing it onto a background");
 
 DEFINE_string(image_dir, "./backgrounds/", "Directory to background images");
 DEFINE_string(color_list, "ff0000,00ff00,0000ff",
               "Comma-separated list of background RRGGBB hex values");
 
+DEFINE_string(metrics_file, "", "If set, write Prometheus metrics to this file every second");
+DEFINE_int32(log_summary_interval, 10,
+             "Seconds between log lines summarizing per-frame events, e.g. inference times");
+DEFINE_string(trace_file, "",
+              "If set, write a Chrome trace of the pipeline to this file, starting at "
+              "--trace_start_frame or when t is pressed");
+DEFINE_int32(trace_start_frame, -1, "Output frame at which to start tracing, -1 to wait for t");
+DEFINE_int32(trace_num_frames, 60, "Number of output frames to trace");
+
+static volatile sig_atomic_t next_model_requested = 0;
+
 int main(int argc, char **argv) {
-    FLAGS_v = 1;
-    FLAGS_logtostderr = true;
     google::ParseCommandLineFlags(&argc, &argv, false);
     google::InitGoogleLogging(argv[0]);
+    EventLog::get().start(std::chrono::seconds(FLAGS_log_summary_interval));
+    CHECK_GE(FLAGS_inference_interval, 1);
 
-    BackgroundRemover bgr(FLAGS_model_filename, FLAGS_model_type);
-    cv::VideoCapture cap(FLAGS_input_device_number);
+    std::string model_list = FLAGS_model_type + ":" + FLAGS_model_filename;
+    if (!FLAGS_model_list.empty()) model_list += "," + FLAGS_model_list;
+    BackgroundRemover::Options options;
+    options.num_threads = FLAGS_num_threads;
+    options.num_interpreters = FLAGS_num_interpreters;
+    options.num_warmup_runs = FLAGS_num_warmup_runs;
+    options.foreground_classes = FLAGS_foreground_classes;
+    options.excluded_parts = FLAGS_excluded_parts;
+    options.refine_radius = FLAGS_refine_radius;
+    options.refine_eps = FLAGS_refine_eps;
+    options.morph_radius = FLAGS_morph_radius;
+    options.min_component_size = FLAGS_min_component_size;
+    options.temporal_alpha = FLAGS_temporal_alpha;
+    options.hysteresis = FLAGS_hysteresis;
+    options.light_wrap = FLAGS_light_wrap;
+    options.color_match = FLAGS_color_match;
+    options.blend_radius = FLAGS_blend_radius;
+    ModelSelector models(model_list, options);
+    signal(SIGHUP, [](int) { next_model_requested = 1; });
 
+    cv::VideoCapture cap;
+    std::unique_ptr<VideoReader> reader;
     cv::Mat frame;
-    cap >> frame;  // Capture a frame to determine output WxH
-    CHECK(!frame.empty()) << "Empty frame captured from video input " << FLAGS_input_device_number;
+    if (FLAGS_input_format.empty()) {
+        cap.open(FLAGS_input_device_number);
+        cap >> frame;  // Capture a frame to determine output WxH
+        CHECK(!frame.empty()) << "Empty frame captured from video input "
+                              << FLAGS_input_device_number;
+    } else {
+        reader = std::make_unique<VideoReader>(
+            ("/dev/video" + std::to_string(FLAGS_input_device_number)).c_str(),
+            cv::Size(FLAGS_input_width, FLAGS_input_height),
+            parsePixelFormat(FLAGS_input_format));
+        frame.create(reader->size(), CV_8UC3);
+    }
 
     BackgroundSelector bgs(FLAGS_image_dir, FLAGS_color_list, frame.cols, frame.rows);
 
-    VideoWriter wri(FLAGS_output_device_path.c_str(), frame.cols, frame.rows, V4L2_PIX_FMT_RGB24);
-
-    bool doMask = true;
-    while (1) {
-        cap >> frame;
-        if (frame.empty()) {
-            LOG(ERROR) << "Empty frame received";
-            break;
-        }
-
-        cv::cvtColor(frame, frame, cv::COLOR_BGR2RGB);
-        if (doMask) bgr.maskBackground(frame, bgs.getBackground());
+    OutputFanout outputs(FLAGS_output.empty() ? "v4l2:" + FLAGS_output_device_path : FLAGS_output,
+                         frame.size(), FLAGS_output_alpha ? V4L2_PIX_FMT_BGR32 : V4L2_PIX_FMT_RGB24,
+                         OutputSink::parseDropPolicy(FLAGS_output_drop_policy),
+                         parseColorMatrix(FLAGS_color_matrix));
+    std::unique_ptr<FramePacer> pacer;
+    if (FLAGS_pace_output) pacer = std::make_unique<FramePacer>(outputs, FLAGS_output_fps);
+    auto writeFrame = [&](const cv::Mat &frame, int64_t timestamp_ns) {
+        if (pacer)
+            pacer->writeFrame(frame, timestamp_ns);
+        else
+            outputs.writeFrame(frame, timestamp_ns);
+    };
+    std::unique_ptr<MaskExporter> mask_exporter;
+    if (!FLAGS_mask_output.empty())
+        mask_exporter = std::make_unique<MaskExporter>(FLAGS_mask_output, frame.cols, frame.rows);
 
-        wri.writeFrame(frame);
+    // Frames whose mask is still being computed, in capture order. Each one keeps the remover
+    // it was submitted to, which stays alive across model switches until the frame is done.
+    struct PendingFrame {
+        cv::Mat frame;
+        int64_t timestamp_ns;  // of capture
+        std::shared_ptr<BackgroundRemover> bgr;
+        std::future<BitMask> mask;  // invalid if masking was disabled or skipped
+        bool doMask;
+    };
+    std::deque<PendingFrame> pending;
+    BitMask last_mask;  // reused for frames without inference
+    long frame_count = 0;
+    long frames_written = 0;
+    long trace_stop_at = -1;  // frames_written at which to write the trace, -1 if not tracing
+    auto startTrace = [&] {
+        if (FLAGS_trace_file.empty() || trace_stop_at >= 0) return;
+        Tracer::get().start();
+        trace_stop_at = frames_written + FLAGS_trace_num_frames;
+    };
 
-        cv::cvtColor(frame, frame, cv::COLOR_RGB2BGR);
-        cv::imshow("frame", frame);
+    bool doMask = true;
+    bool first = true;
 
-        auto key = cv::waitKey(1);
-        switch (key) {
+    // Handles the preview window's events and keys, false to quit.
+    auto handleKeys = [&] {
+        switch (cv::waitKey(1)) {
             case ' ':
                 doMask = !doMask;
                 LOG(INFO) << (doMask ? "enabled" : "disabled") << " mask";
@@ -78,11 +202,114 @@ int main(int argc, char **argv) {
                 bgs.selectNextImage();
                 break;
 
+            case 'M':
+                models.selectPrevModel();
+                break;
+
+            case 'm':
+                models.selectNextModel();
+                break;
+
+            case 't':
+                startTrace();
+                break;
+
             case 'q':
-                goto out;
+                return false;
+        }
+        return true;
+    };
+
+    auto metrics_written = std::chrono::steady_clock::now();
+    while (1) {
+        if (next_model_requested) {
+            next_model_requested = 0;
+            models.selectNextModel();
+        }
+        models.update();
+        auto bgr = models.getRemover();
+
+        // Not reused, earlier frames may still be in flight. small is the model's input, which
+        // the reader may decode at a lower resolution.
+        cv::Mat frame, small;
+        int64_t timestamp_ns;
+        if (reader) {
+            TraceSpan span("capture");
+            if (!reader->read(frame, small, timestamp_ns, bgr->inputSize())) {
+                // Keep the preview window responsive while the camera stalls.
+                if (!handleKeys()) break;
+                continue;
+            }
+        } else {
+            cv::Mat captured;
+            {
+                TraceSpan span("capture");
+                cap >> captured;
+            }
+            if (captured.empty()) {
+                LOG(ERROR) << "Empty frame received";
+                break;
+            }
+            timestamp_ns = monotonicNs();
+            TraceSpan span("convert");
+            convertToRgb(captured, captured.size(), V4L2_PIX_FMT_BGR24, frame);
+            small = frame;
+        }
+
+        PendingFrame p{frame, timestamp_ns, bgr, {}, doMask};
+        if (doMask && frame_count++ % FLAGS_inference_interval == 0) p.mask = bgr->getMask(small);
+        pending.push_back(std::move(p));
+
+        // Keep all interpreters busy; results are consumed in order.
+        if (pending.size() < bgr->numInterpreters()) continue;
+        PendingFrame out = std::move(pending.front());
+        pending.pop_front();
+        frame = out.frame;
+
+        if (out.mask.valid()) {
+            TraceSpan span("wait_mask");
+            last_mask = out.mask.get();
         }
+        const bool masked = out.doMask && !last_mask.empty();
+        if (mask_exporter && masked) mask_exporter->publish(last_mask, out.timestamp_ns);
+        if (FLAGS_output_alpha) {
+            cv::Mat matte;  // not reused, the outputs may still hold the previous one
+            if (masked)
+                out.bgr->matteMask(frame, last_mask, matte);
+            else
+                convertRgb(frame, V4L2_PIX_FMT_BGR32, matte);
+            writeFrame(matte, out.timestamp_ns);
+        } else {
+            if (masked) out.bgr->applyMask(frame, last_mask, bgs.getBackground());
+            writeFrame(frame, out.timestamp_ns);
+        }
+        out = {};
+
+        frames_written++;
+        if (frames_written == FLAGS_trace_start_frame) startTrace();
+        if (frames_written == trace_stop_at) {
+            Tracer::get().stop(FLAGS_trace_file);
+            trace_stop_at = -1;
+        }
+
+        if (first) {
+            double startup = Metrics::processUptime();
+            Metrics::get().setGauge("bgr_time_to_first_frame_seconds", startup);
+            LOG(INFO) << "First frame written " << startup << "s after process start";
+            first = false;
+        }
+        if (!FLAGS_metrics_file.empty() &&
+            std::chrono::steady_clock::now() - metrics_written > std::chrono::seconds(1)) {
+            Metrics::get().writeToFile(FLAGS_metrics_file);
+            metrics_written = std::chrono::steady_clock::now();
+        }
+
+        cv::Mat preview;  // frame may still be queued for writing
+        convertRgb(frame, V4L2_PIX_FMT_BGR24, preview);
+        cv::imshow("frame", preview);
+
+        if (!handleKeys()) break;
     }
-out:
 
     return 0;
 }
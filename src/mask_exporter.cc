@@ -0,0 +1,68 @@
+#include "mask_exporter.h"
+
+#include <linux/videodev2.h>
+
+#include "compositor.h"
+#include "glog/logging.h"
+#include "metrics.h"
+#include "parallel.h"
+#include "trace.h"
+
+MaskExporter::MaskExporter(const std::string &spec, int width, int height)
+    : width_(width),
+      height_(height),
+      sink_(makeOutputSink(spec, width, height, V4L2_PIX_FMT_GREY)) {
+    sink_->setLatencyMetric("bgr_capture_to_mask_output_seconds");
+    thread_ = std::thread(&MaskExporter::run, this);
+}
+
+MaskExporter::~MaskExporter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void MaskExporter::publish(BitMask mask, int64_t timestamp_ns) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!pending_.empty()) Metrics::get().addCounter("bgr_mask_export_dropped_total");
+        pending_ = std::move(mask);
+        pending_timestamp_ = timestamp_ns;
+    }
+    cv_.notify_one();
+}
+
+// Upsamples straight into the sink's buffer, which for a ShmRing is the shared memory itself.
+void MaskExporter::write(const BitMask &mask, cv::Mat &out) {
+    MaskSampler sampler(mask, cv::Size(width_, height_));
+    parallelRows(height_, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            unsigned char *row = out.ptr<unsigned char>(y);
+            sampler.sampleRow(y, row);
+            for (int x = 0; x < width_; x++) row[x] = ~row[x];
+        }
+    });
+}
+
+void MaskExporter::run() {
+    setThreadName("mask-export");
+    while (1) {
+        BitMask mask;
+        int64_t timestamp_ns;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+            if (stopping_) return;
+            std::swap(mask, pending_);
+            timestamp_ns = pending_timestamp_;
+        }
+
+        TraceSpan span("mask_export");
+        cv::Mat out = sink_->beginFrame();
+        write(mask, out);
+        sink_->commitFrame(timestamp_ns);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef MASK_EXPORTER_H
+#define MASK_EXPORTER_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <string>
+#include <thread>
+
+#include "bit_mask.h"
+#include "output_sink.h"
+
+// Publishes the model's raw mask of every output frame, upsampled to the frame size as GREY
+// (255 for foreground, 0 for background), to a second OutputSink. The sink is written by a
+// thread of its own; if it is still busy with the previous mask, that one is replaced, so a
+// slow consumer never stalls the caller.
+class MaskExporter {
+    const int width_, height_;
+    std::unique_ptr<OutputSink> sink_;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    BitMask pending_;  // empty if there is nothing to publish
+    int64_t pending_timestamp_ = 0;
+    bool stopping_ = false;
+
+    void run();
+    void write(const BitMask &mask, cv::Mat &out);
+
+   public:
+    // spec as for makeOutputSink().
+    MaskExporter(const std::string &spec, int width, int height);
+    ~MaskExporter();
+
+    // timestamp_ns is the capture time of the frame the mask belongs to.
+    void publish(BitMask mask, int64_t timestamp_ns);
+};
+
+#endif  // MASK_EXPORTER_H
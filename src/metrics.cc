@@ -0,0 +1,95 @@
+#include "metrics.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#include "glog/logging.h"
+
+static const std::vector<double> latency_buckets = {.001, .0025, .005, .01, .02, .033,
+                                                    .05,  .1,    .25,  .5,  1.};
+
+Metrics &Metrics::get() {
+    static Metrics metrics;
+    return metrics;
+}
+
+double Metrics::processUptime() {
+    // Field 22 of /proc/self/stat is the start time in clock ticks since boot. The second field
+    // (comm) may contain spaces, so start counting after its closing parenthesis.
+    std::ifstream f("/proc/self/stat");
+    std::string stat((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    auto pos = stat.rfind(')');
+    if (pos == std::string::npos) {
+        LOG(WARNING) << "Can't parse /proc/self/stat";
+        return 0;
+    }
+    std::istringstream fields(stat.substr(pos + 2));
+    std::string field;
+    for (int i = 3; i < 22; i++) fields >> field;
+    unsigned long long starttime;
+    fields >> starttime;
+
+    struct timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9 - (double)starttime / sysconf(_SC_CLK_TCK);
+}
+
+void Metrics::addCounter(const std::string &name, double value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    counters_[name] += value;
+}
+
+void Metrics::setGauge(const std::string &name, double value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    gauges_[name] = value;
+}
+
+void Metrics::observe(const std::string &name, double value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Histogram &h = histograms_[name];
+    if (h.bounds.empty()) {
+        h.bounds = latency_buckets;
+        h.counts.resize(h.bounds.size() + 1 /* +Inf */);
+    }
+    h.counts[std::lower_bound(h.bounds.begin(), h.bounds.end(), value) - h.bounds.begin()]++;
+    h.sum += value;
+    h.count++;
+}
+
+void Metrics::write(std::ostream &os) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &[name, value] : counters_)
+        os << "# TYPE " << name << " counter\n" << name << " " << value << "\n";
+    for (const auto &[name, value] : gauges_)
+        os << "# TYPE " << name << " gauge\n" << name << " " << value << "\n";
+    for (const auto &[name, h] : histograms_) {
+        os << "# TYPE " << name << " histogram\n";
+        unsigned long cumulative = 0;
+        for (size_t i = 0; i < h.bounds.size(); i++) {
+            cumulative += h.counts[i];
+            os << name << "_bucket{le=\"" << h.bounds[i] << "\"} " << cumulative << "\n";
+        }
+        os << name << "_bucket{le=\"+Inf\"} " << h.count << "\n";
+        os << name << "_sum " << h.sum << "\n" << name << "_count " << h.count << "\n";
+    }
+}
+
+void Metrics::writeToFile(const std::string &path) const {
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream f(tmp);
+        if (!f) {
+            LOG(WARNING) << "Can't open " << tmp << " for writing";
+            return;
+        }
+        write(f);
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        PLOG(WARNING) << "Can't rename " << tmp << " to " << path;
+}
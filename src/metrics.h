@@ -0,0 +1,43 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Process-wide counters, gauges and histograms, exported in the Prometheus text format (e.g.
+// for node_exporter's textfile collector). All methods are thread-safe.
+class Metrics {
+    struct Histogram {
+        std::vector<double> bounds;
+        std::vector<unsigned long> counts;  // per bucket, not cumulative
+        double sum = 0;
+        unsigned long count = 0;
+    };
+
+    mutable std::mutex mutex_;
+    std::map<std::string, double> counters_;
+    std::map<std::string, double> gauges_;
+    std::map<std::string, Histogram> histograms_;
+
+    Metrics() = default;
+
+   public:
+    static Metrics &get();
+
+    // Seconds since the process was started by the kernel.
+    static double processUptime();
+
+    void addCounter(const std::string &name, double value = 1);
+    void setGauge(const std::string &name, double value);
+    // Buckets are in seconds and suitable for per-frame latencies.
+    void observe(const std::string &name, double value);
+
+    void write(std::ostream &os) const;
+    // Replaces path atomically, so readers never see a partial file.
+    void writeToFile(const std::string &path) const;
+};
+
+#endif  // METRICS_H
@@ -0,0 +1,96 @@
+#include "model_selector.h"
+
+#include <chrono>
+#include <sstream>
+
+#include "glog/logging.h"
+#include "trace.h"
+
+std::vector<ModelSelector::Model> ModelSelector::parseModelList(
+    std::string model_list, const BackgroundRemover::Options &options) {
+    std::vector<ModelSelector::Model> ret;
+
+    std::stringstream models(model_list);
+    for (std::string model; std::getline(models, model, ',');) {
+        auto colon = model.find(':');
+        CHECK(colon != std::string::npos) << "Model " << model << " is not type:filename";
+        Model m{model.substr(0, colon), model.substr(colon + 1)};
+        // Only the first model is loaded right away, catch typos in the others and options
+        // they don't support before they are selected.
+        std::string error = BackgroundRemover::checkModel(m.filename, m.type, options);
+        CHECK(error.empty()) << error;
+        ret.push_back(std::move(m));
+    }
+
+    return ret;
+}
+
+std::ostream &operator<<(std::ostream &os, const ModelSelector::Model &m) {
+    return os << "Model(" << m.type << ", \"" << m.filename << "\")";
+}
+
+ModelSelector::ModelSelector(std::string model_list, const BackgroundRemover::Options &options)
+    : models_(parseModelList(model_list, options)),
+      options_(options),
+      curr_model_(0),
+      loading_model_(-1) {
+    CHECK(!models_.empty()) << "No models";
+    curr_remover_ = load(models_[curr_model_]);
+}
+
+std::shared_ptr<BackgroundRemover> ModelSelector::load(const Model &m) const {
+    LOG(INFO) << "Loading " << m;
+    // The file may have changed since startup; don't let the CHECKs in the constructor take
+    // down the running pipeline for that.
+    std::string error = BackgroundRemover::checkModel(m.filename, m.type, options_);
+    if (!error.empty()) {
+        LOG(ERROR) << "Can't load " << m << ": " << error;
+        return nullptr;
+    }
+    return std::make_shared<BackgroundRemover>(m.filename, m.type, options_);
+}
+
+void ModelSelector::select(int model) {
+    if (loading_.valid() || loaded_) {
+        LOG(WARNING) << "Still loading " << models_[loading_model_] << ", ignoring";
+        return;
+    }
+    if (model == curr_model_) return;
+
+    loading_model_ = model;
+    loading_ = std::async(std::launch::async, [this, model] {
+        setThreadName("model-load");
+        return load(models_[model]);
+    });
+}
+
+void ModelSelector::selectPrevModel() {
+    select(curr_model_ == 0 ? models_.size() - 1 : curr_model_ - 1);
+}
+
+void ModelSelector::selectNextModel() {
+    select(curr_model_ == models_.size() - 1 ? 0 : curr_model_ + 1);
+}
+
+void ModelSelector::update() {
+    if (loading_.valid() &&
+        loading_.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        loaded_ = loading_.get();
+        if (!loaded_) LOG(ERROR) << "Keeping " << models_[curr_model_];
+    }
+    // Wait until the model before has been freed, there's only room for one retired model.
+    if (!retired_ && loaded_) {
+        retired_ = std::move(curr_remover_);
+        curr_remover_ = std::move(loaded_);
+        curr_model_ = loading_model_;
+        LOG(INFO) << "Switched to " << models_[curr_model_];
+    }
+
+    if (retired_ && retired_.use_count() == 1) {
+        // Reset on the freeing thread, the lambda itself is destroyed by the future.
+        freeing_ = std::async(std::launch::async,
+                              [r = std::move(retired_)]() mutable { r.reset(); });
+    }
+}
+
+std::shared_ptr<BackgroundRemover> ModelSelector::getRemover() const { return curr_remover_; }
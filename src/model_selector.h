@@ -0,0 +1,54 @@
+#ifndef MODEL_SELECTOR_H
+#define MODEL_SELECTOR_H
+
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "background_remover.h"
+
+// Cycles through a list of models. A newly selected model is loaded and warmed up in the
+// background while the current one keeps processing frames; update() switches over once it is
+// ready, so the output is never interrupted.
+class ModelSelector {
+    struct Model {
+        std::string type;
+        std::string filename;
+    };
+
+    const std::vector<Model> models_;
+    const BackgroundRemover::Options options_;
+
+    int curr_model_;
+    std::shared_ptr<BackgroundRemover> curr_remover_;
+
+    int loading_model_;
+    // Valid from select() until the load finishes; a null result means it failed.
+    std::future<std::shared_ptr<BackgroundRemover>> loading_;
+    std::shared_ptr<BackgroundRemover> loaded_;  // waiting for the retired model to be freed
+
+    // The previous remover is freed on a separate thread once no in-flight frame uses it.
+    std::shared_ptr<BackgroundRemover> retired_;
+    std::future<void> freeing_;
+
+    static std::vector<Model> parseModelList(std::string model_list,
+                                             const BackgroundRemover::Options &options);
+    std::shared_ptr<BackgroundRemover> load(const Model &m) const;
+    void select(int model);
+
+    friend std::ostream &operator<<(std::ostream &os, const Model &m);
+
+   public:
+    // model_list is a comma-separated list of type:filename pairs; the first one is loaded
+    // synchronously.
+    ModelSelector(std::string model_list, const BackgroundRemover::Options &options);
+    void selectPrevModel();
+    void selectNextModel();
+
+    // Must be called between frames.
+    void update();
+    std::shared_ptr<BackgroundRemover> getRemover() const;
+};
+
+#endif  // MODEL_SELECTOR_H
@@ -0,0 +1,73 @@
+#include "output_fanout.h"
+
+#include <linux/videodev2.h>
+
+#include <algorithm>
+#include <execution>
+#include <opencv2/imgproc.hpp>
+#include <sstream>
+
+#include "glog/logging.h"
+#include "pixel_format.h"
+#include "trace.h"
+
+OutputFanout::OutputFanout(const std::string &list, cv::Size source_size, uint32_t source_format,
+                           OutputSink::DropPolicy policy, ColorMatrix matrix)
+    : source_size_(source_size), source_format_(source_format), matrix_(matrix) {
+    CHECK(source_format_ == V4L2_PIX_FMT_RGB24 || source_format_ == V4L2_PIX_FMT_BGR32);
+
+    std::stringstream outputs(list);
+    for (std::string output; std::getline(outputs, output, ',');) {
+        std::stringstream options(output);
+        Output o{"", source_size_, source_format_};
+        std::getline(options, o.spec, '@');
+        for (std::string option; std::getline(options, option, '@');) {
+            int width, height;
+            char x;
+            std::stringstream size(option);
+            if (size >> width >> x >> height && x == 'x' && size.eof()) {
+                CHECK(width > 0 && height > 0)
+                    << "Output " << output << " needs a positive size, not " << option;
+                o.size = cv::Size(width, height);
+            } else {
+                o.pixelformat = parsePixelFormat(option);
+            }
+        }
+        CHECK(source_format_ != V4L2_PIX_FMT_BGR32 || o.pixelformat == source_format_)
+            << "Output " << output << " can't be converted from bgr32";
+
+        LOG(INFO) << "Output " << o.spec << ": " << o.size.width << "x" << o.size.height;
+        o.sink = makeOutputSink(o.spec, o.size.width, o.size.height, o.pixelformat, policy);
+        outputs_.push_back(std::move(o));
+    }
+    CHECK(!outputs_.empty()) << "No outputs";
+}
+
+void OutputFanout::write(const Output &o, const cv::Mat &frame, int64_t timestamp_ns) {
+    TraceSpan span("write_frame");
+    if (o.size == source_size_ && o.pixelformat == source_format_) {
+        o.sink->writeFrame(frame, timestamp_ns);
+        return;
+    }
+
+    // The last step writes straight into the sink's buffer. Integer downscaling of an rgb
+    // source is fused into the conversion.
+    cv::Mat slot = o.sink->beginFrame();
+    const int factor = source_size_.width / o.size.width;
+    if (source_format_ == V4L2_PIX_FMT_RGB24 && o.size * factor == source_size_) {
+        convertRgb(frame, o.pixelformat, slot, factor, matrix_);
+    } else if (o.pixelformat == source_format_) {
+        cv::resize(frame, slot, o.size, 0, 0, cv::INTER_AREA);
+    } else {
+        cv::Mat scaled;
+        cv::resize(frame, scaled, o.size, 0, 0, cv::INTER_AREA);
+        convertRgb(scaled, o.pixelformat, slot, 1, matrix_);
+    }
+    o.sink->commitFrame(timestamp_ns);
+}
+
+void OutputFanout::writeFrame(const cv::Mat &frame, int64_t timestamp_ns) {
+    CHECK(frame.size() == source_size_);
+    std::for_each(std::execution::par, outputs_.begin(), outputs_.end(),
+                  [&](const Output &o) { write(o, frame, timestamp_ns); });
+}
@@ -0,0 +1,42 @@
+#ifndef OUTPUT_FANOUT_H
+#define OUTPUT_FANOUT_H
+
+#include <memory>
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+#include "color_convert.h"
+#include "output_sink.h"
+
+// Writes every processed frame to several sinks, each with its own size and pixel format, so
+// that capture, inference and compositing are shared. The outputs are scaled and converted in
+// parallel from the one source frame.
+class OutputFanout {
+    struct Output {
+        std::string spec;
+        cv::Size size;
+        uint32_t pixelformat;
+        std::unique_ptr<OutputSink> sink;
+    };
+
+    const cv::Size source_size_;
+    const uint32_t source_format_;
+    const ColorMatrix matrix_;
+    std::vector<Output> outputs_;
+
+    void write(const Output &o, const cv::Mat &frame, int64_t timestamp_ns);
+
+   public:
+    // list is comma-separated sink specs (see makeOutputSink()), each optionally followed by
+    // @WIDTHxHEIGHT and @format (see parsePixelFormat()), e.g.
+    // "v4l2:/dev/video2,file:/tmp/rec.fifo,v4l2:/dev/video4@640x360@yuyv". Outputs default to
+    // the source's size and format. A bgr32 source (with alpha) can only be scaled.
+    OutputFanout(const std::string &list, cv::Size source_size, uint32_t source_format,
+                 OutputSink::DropPolicy policy, ColorMatrix matrix = ColorMatrix::BT601);
+
+    // frame's pixels must not be modified afterwards. timestamp_ns is its capture time.
+    void writeFrame(const cv::Mat &frame, int64_t timestamp_ns);
+};
+
+#endif  // OUTPUT_FANOUT_H
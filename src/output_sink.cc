@@ -0,0 +1,81 @@
+#include "output_sink.h"
+
+#include "fd_sink.h"
+#include "glog/logging.h"
+#include "metrics.h"
+#include "pixel_format.h"
+#include "shm_ring.h"
+#include "timestamp.h"
+#include "video_writer.h"
+
+OutputSink::DropPolicy OutputSink::parseDropPolicy(const std::string &policy) {
+    if (policy == "block") return DropPolicy::Block;
+    if (policy == "drop_newest") return DropPolicy::DropNewest;
+    if (policy == "drop_oldest") return DropPolicy::DropOldest;
+    if (policy == "repeat_last") return DropPolicy::RepeatLast;
+    CHECK(0) << "Unknown drop policy " << policy;
+    return DropPolicy::Block;
+}
+
+void OutputSink::delivered(int64_t timestamp_ns) const {
+    if (!timestamp_ns || latency_metric_.empty()) return;
+    Metrics::get().observe(latency_metric_, (monotonicNs() - timestamp_ns) / 1e9);
+}
+
+void OutputSink::writeFrame(const cv::Mat &frame, int64_t timestamp_ns) {
+    cv::Mat slot = beginFrame();
+    CHECK(frame.size() == slot.size());
+    CHECK_EQ(frame.type(), slot.type());
+    frame.copyTo(slot);
+    commitFrame(timestamp_ns);
+}
+
+// Publishes to a ShmRing, whose slots are handed out directly.
+class ShmSink : public OutputSink {
+    const int width_, height_, type_;
+    ShmRing ring_;
+
+   public:
+    ShmSink(const std::string &name, int width, int height, uint32_t pixelformat)
+        : width_(width),
+          height_(height),
+          type_(CV_8UC(bytesPerPixel(pixelformat))),
+          ring_(name, width, height, pixelformat, width * bytesPerPixel(pixelformat)) {}
+
+    cv::Mat beginFrame() override { return cv::Mat(height_, width_, type_, ring_.beginFrame()); }
+    void commitFrame(int64_t timestamp_ns) override {
+        ring_.commitFrame(timestamp_ns);
+        delivered(timestamp_ns);
+    }
+};
+
+class NullSink : public OutputSink {
+    cv::Mat buffer_;
+
+   public:
+    NullSink(int width, int height, uint32_t pixelformat)
+        : buffer_(height, width, CV_8UC(bytesPerPixel(pixelformat))) {}
+
+    cv::Mat beginFrame() override { return buffer_; }
+    void commitFrame(int64_t timestamp_ns) override { delivered(timestamp_ns); }
+    void writeFrame(const cv::Mat &frame, int64_t timestamp_ns) override {
+        delivered(timestamp_ns);
+    }
+};
+
+std::unique_ptr<OutputSink> makeOutputSink(const std::string &spec, int width, int height,
+                                           uint32_t pixelformat, OutputSink::DropPolicy policy) {
+    if (spec == "null") return std::make_unique<NullSink>(width, height, pixelformat);
+
+    auto colon = spec.find(':');
+    CHECK(colon != std::string::npos) << "Output " << spec << " is not type:path or null";
+    const std::string type = spec.substr(0, colon), path = spec.substr(colon + 1);
+
+    if (type == "v4l2")
+        return std::make_unique<VideoWriter>(path.c_str(), width, height, pixelformat, policy);
+    if (type == "file")
+        return std::make_unique<FileSink>(path, width, height, pixelformat, policy);
+    if (type == "shm") return std::make_unique<ShmSink>(path, width, height, pixelformat);
+    CHECK(0) << "Unknown output type " << type;
+    return nullptr;
+}
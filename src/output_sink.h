@@ -0,0 +1,56 @@
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include <cstdint>
+#include <memory>
+#include <opencv2/core.hpp>
+#include <string>
+
+// Where output frames go. Frames are filled in place: beginFrame() hands out the buffer for the
+// next frame, commitFrame() publishes it. Sinks that can write from any buffer also take whole
+// frames with writeFrame() without copying them.
+class OutputSink {
+    std::string latency_metric_ = "bgr_capture_to_output_seconds";
+
+   protected:
+    // To be called when the consumer gets a frame, for the latency histogram.
+    void delivered(int64_t timestamp_ns) const;
+
+   public:
+    // What to do with frames a sink can't take right away.
+    enum class DropPolicy {
+        Block,       // wait for the consumer
+        DropNewest,  // discard the new frame if one is still queued
+        DropOldest,  // replace the queued frame with the new one
+        RepeatLast,  // like DropOldest, and write the last frame again if no new one arrives
+                     // within 1.5 frame intervals
+    };
+    static DropPolicy parseDropPolicy(const std::string &policy);
+
+    virtual ~OutputSink() = default;
+
+    // height rows of width pixels, continuous, valid until commitFrame(). timestamp_ns is the
+    // frame's capture time (see timestamp.h).
+    virtual cv::Mat beginFrame() = 0;
+    virtual void commitFrame(int64_t timestamp_ns) = 0;
+
+    // Publishes frame, whose pixels must not be modified afterwards; pass a fresh Mat for each
+    // frame. Copies it into a slot unless the sink can do without.
+    virtual void writeFrame(const cv::Mat &frame, int64_t timestamp_ns);
+
+    // The histogram capture-to-output latencies go to, empty to disable.
+    void setLatencyMetric(const std::string &name) { latency_metric_ = name; }
+};
+
+// spec is one of
+//   v4l2:/dev/videoN  a v4l2loopback device
+//   file:path         a raw file or FIFO, e.g. for piping into ffmpeg
+//   shm:name          a ShmRing in /dev/shm, for consumers on the same host
+//   null              discards all frames, for benchmarks
+// The drop policy applies to the v4l2 and file sinks; the others never block.
+std::unique_ptr<OutputSink> makeOutputSink(const std::string &spec, int width, int height,
+                                           uint32_t pixelformat,
+                                           OutputSink::DropPolicy policy =
+                                               OutputSink::DropPolicy::Block);
+
+#endif  // OUTPUT_SINK_H
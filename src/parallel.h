@@ -0,0 +1,18 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <execution>
+#include <numeric>
+#include <vector>
+
+// Splits [0, rows) into bands of band rows and runs f(begin, end) on them in parallel.
+template <typename F>
+void parallelRows(int rows, F f, int band = 16) {
+    std::vector<int> bands((rows + band - 1) / band);
+    std::iota(bands.begin(), bands.end(), 0);
+    std::for_each(std::execution::par, bands.begin(), bands.end(),
+                  [&](int b) { f(b * band, std::min(rows, (b + 1) * band)); });
+}
+
+#endif  // PARALLEL_H
@@ -0,0 +1,39 @@
+#include "pixel_format.h"
+
+#include <linux/videodev2.h>
+
+#include "glog/logging.h"
+
+int bytesPerPixel(uint32_t pixelformat) {
+    switch (pixelformat) {
+        case V4L2_PIX_FMT_GREY:
+            return 1;
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+            return 2;
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_BGR24:
+            return 3;
+        case V4L2_PIX_FMT_RGB32:
+        case V4L2_PIX_FMT_BGR32:
+            return 4;
+        default:
+            CHECK(0) << "Unknown format " << pixelformat;
+            return -1;
+    }
+}
+
+uint32_t parsePixelFormat(const std::string &name) {
+    if (name == "grey") return V4L2_PIX_FMT_GREY;
+    if (name == "yuyv") return V4L2_PIX_FMT_YUYV;
+    if (name == "uyvy") return V4L2_PIX_FMT_UYVY;
+    if (name == "rgb24") return V4L2_PIX_FMT_RGB24;
+    if (name == "bgr24") return V4L2_PIX_FMT_BGR24;
+    if (name == "rgb32") return V4L2_PIX_FMT_RGB32;
+    if (name == "bgr32") return V4L2_PIX_FMT_BGR32;
+    if (name == "nv12") return V4L2_PIX_FMT_NV12;
+    if (name == "i420") return V4L2_PIX_FMT_YUV420;
+    if (name == "mjpeg") return V4L2_PIX_FMT_MJPEG;
+    CHECK(0) << "Unknown pixel format " << name;
+    return 0;
+}
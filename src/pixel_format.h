@@ -0,0 +1,13 @@
+#ifndef PIXEL_FORMAT_H
+#define PIXEL_FORMAT_H
+
+#include <cstdint>
+#include <string>
+
+// Bytes per pixel of a packed v4l2 pixel format.
+int bytesPerPixel(uint32_t pixelformat);
+// The v4l2 pixel format for one of grey, yuyv, uyvy, rgb24, bgr24, rgb32, bgr32, and for
+// capture also nv12, i420 and mjpeg.
+uint32_t parsePixelFormat(const std::string &name);
+
+#endif  // PIXEL_FORMAT_H
@@ -0,0 +1,69 @@
+#include "shm_ring.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "glog/logging.h"
+#include "timestamp.h"
+
+static size_t alignUp(size_t n, size_t alignment) {
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+ShmRing::ShmRing(const std::string &name, int width, int height, int pixelformat,
+                 int bytes_per_line, int num_slots)
+    : name_(name[0] == '/' ? name : "/" + name) {
+    CHECK_GT(num_slots, 0);
+    const size_t slot_size = alignUp(sizeof(ShmRingSlot) + (size_t)bytes_per_line * height, 64);
+    size_ = alignUp(sizeof(ShmRingHeader), 64) + slot_size * num_slots;
+
+    int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    PCHECK(fd >= 0) << "Can't open shared memory " << name_;
+    PCHECK(ftruncate(fd, size_) == 0) << "Can't resize shared memory " << name_;
+    void *p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    PCHECK(p != MAP_FAILED) << "Can't map shared memory " << name_;
+    close(fd);
+
+    // The file is zero-filled, so all sequence numbers start out as 0.
+    header_ = static_cast<ShmRingHeader *>(p);
+    header_->version = 1;
+    header_->width = width;
+    header_->height = height;
+    header_->bytes_per_line = bytes_per_line;
+    header_->pixelformat = pixelformat;
+    header_->num_slots = num_slots;
+    header_->slot_size = slot_size;
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic = ShmRingHeader::magic_value;
+
+    LOG(INFO) << "Publishing " << width << "x" << height << " frames to /dev/shm" << name_;
+}
+
+ShmRing::~ShmRing() {
+    munmap(header_, size_);
+    shm_unlink(name_.c_str());
+}
+
+ShmRingSlot *ShmRing::slot(uint64_t sequence) const {
+    unsigned char *slots = reinterpret_cast<unsigned char *>(header_) +
+                           alignUp(sizeof(ShmRingHeader), 64);
+    return reinterpret_cast<ShmRingSlot *>(slots +
+                                           (sequence % header_->num_slots) * header_->slot_size);
+}
+
+unsigned char *ShmRing::beginFrame() {
+    ShmRingSlot *s = slot(++sequence_);
+    s->sequence.store(0, std::memory_order_relaxed);
+    // Readers that see the new data must also see the slot as invalid.
+    std::atomic_thread_fence(std::memory_order_release);
+    return s->data();
+}
+
+void ShmRing::commitFrame(int64_t capture_timestamp_ns) {
+    ShmRingSlot *s = slot(sequence_);
+    s->timestamp_ns = monotonicNs();
+    s->capture_timestamp_ns = capture_timestamp_ns;
+    s->sequence.store(sequence_, std::memory_order_release);
+    header_->sequence.store(sequence_, std::memory_order_release);
+}
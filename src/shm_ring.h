@@ -0,0 +1,59 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// A ring of frame slots in POSIX shared memory (/dev/shm/<name>) for consumers on the same host.
+// The single writer never waits for readers; a reader that falls more than num_slots frames
+// behind just sees the newer frames.
+//
+// Layout: a ShmRingHeader, then num_slots slots of slot_size bytes, each starting with a
+// ShmRingSlot. Slots and frame data are 64 byte aligned. To read the latest frame:
+//
+//     n = header->sequence;                  // 0 if nothing was published yet
+//     slot = first slot + (n % num_slots) * slot_size;
+//     check slot->sequence == n, copy the frame after it, check slot->sequence == n again
+//
+// with acquire loads; if a check fails the writer lapped the reader and it should retry.
+struct ShmRingHeader {
+    static constexpr uint32_t magic_value = 0x4d524742;  // "BGRM"
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height, bytes_per_line, pixelformat;  // v4l2 fourcc
+    uint32_t num_slots, slot_size;
+    std::atomic<uint64_t> sequence;  // of the last published frame, starting at 1
+};
+
+struct alignas(64) ShmRingSlot {
+    std::atomic<uint64_t> sequence;  // of the frame after it, 0 while it is being written
+    int64_t timestamp_ns;            // CLOCK_MONOTONIC at publication
+    int64_t capture_timestamp_ns;    // CLOCK_MONOTONIC at capture, 0 if unknown
+
+    unsigned char *data() { return reinterpret_cast<unsigned char *>(this + 1); }
+};
+
+class ShmRing {
+    const std::string name_;
+    size_t size_;
+    ShmRingHeader *header_;
+    uint64_t sequence_ = 0;  // of the frame being written
+
+    ShmRingSlot *slot(uint64_t sequence) const;
+
+   public:
+    ShmRing(const std::string &name, int width, int height, int pixelformat, int bytes_per_line,
+            int num_slots = 4);
+    ~ShmRing();
+    ShmRing(const ShmRing &) = delete;
+    ShmRing &operator=(const ShmRing &) = delete;
+
+    // Returns the next slot's frame buffer (height rows of bytes_per_line) to be filled in
+    // place, then published with commitFrame().
+    unsigned char *beginFrame();
+    void commitFrame(int64_t capture_timestamp_ns);
+};
+
+#endif  // SHM_RING_H
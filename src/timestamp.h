@@ -0,0 +1,16 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <time.h>
+
+#include <cstdint>
+
+// Frame timestamps are nanoseconds on CLOCK_MONOTONIC, the clock v4l2 drivers stamp buffers
+// with, and 0 where unknown.
+inline int64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif  // TIMESTAMP_H
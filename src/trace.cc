@@ -0,0 +1,156 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+
+#include "glog/logging.h"
+
+struct Tracer::Ring {
+    static constexpr uint64_t capacity = 1 << 14;
+
+    long tid;
+    std::string thread_name;
+    std::atomic<uint64_t> head{0};  // number of events ever recorded
+    Event events[capacity];
+};
+
+namespace {
+// Retires the thread's ring when the thread exits, e.g. an interpreter worker after a model
+// switch. It is still written by the next stop(), and reused for new threads after the next
+// start().
+struct RingHolder {
+    std::shared_ptr<Tracer::Ring> ring;
+    ~RingHolder() {
+        if (ring) Tracer::get().removeRing(ring.get());
+    }
+};
+thread_local RingHolder holder;
+}  // namespace
+
+Tracer &Tracer::get() {
+    static Tracer tracer;
+    return tracer;
+}
+
+Tracer::Ring &Tracer::ring() {
+    if (!holder.ring) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.empty()) {
+            holder.ring = std::make_shared<Ring>();
+        } else {
+            holder.ring = std::move(free_.back());
+            free_.pop_back();
+            holder.ring->head.store(0, std::memory_order_relaxed);
+        }
+        holder.ring->tid = syscall(SYS_gettid);
+        char name[16] = {};
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        holder.ring->thread_name = name;
+        rings_.push_back(holder.ring);
+    }
+    return *holder.ring;
+}
+
+void Tracer::removeRing(const Ring *ring) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(rings_.begin(), rings_.end(),
+                           [ring](const auto &r) { return r.get() == ring; });
+    if (it == rings_.end()) return;
+    retired_.push_back(std::move(*it));
+    rings_.erase(it);
+}
+
+void Tracer::record(const char *name, int64_t begin_ns, int64_t end_ns) {
+    Ring &r = ring();
+    const uint64_t head = r.head.load(std::memory_order_relaxed);
+    r.events[head % Ring::capacity] = {name, begin_ns, end_ns};
+    r.head.store(head + 1, std::memory_order_release);
+}
+
+void Tracer::start() {
+    if (recording()) return;
+    if (writing_.valid() && writing_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return;
+    // No trace is being written, so nobody reads the retired rings anymore.
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.insert(free_.end(), retired_.begin(), retired_.end());
+        retired_.clear();
+    }
+    start_ns_ = monotonicNs();
+    recording_ = true;
+    LOG(INFO) << "Tracing started";
+}
+
+void setThreadName(const std::string &name) {
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+}
+
+static std::string jsonString(const std::string &s) {
+    std::string ret = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') ret += '\\';
+        if (c >= ' ') ret += c;
+    }
+    return ret + "\"";
+}
+
+// Copies the events of [start_ns, stop_ns] out of the rings, while threads may still record,
+// and writes them as complete ("X") events with timestamps in microseconds since start_ns.
+static void writeTrace(const std::vector<std::shared_ptr<Tracer::Ring>> &rings, int64_t start_ns,
+                       int64_t stop_ns, const std::string &path) {
+    std::ofstream f(path);
+    if (!f) {
+        LOG(ERROR) << "Can't write trace to " << path;
+        return;
+    }
+    const int pid = getpid();
+    f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    size_t count = 0;
+    for (const auto &r : rings) {
+        const uint64_t head = r->head.load(std::memory_order_acquire);
+        const uint64_t first = head > Tracer::Ring::capacity ? head - Tracer::Ring::capacity : 0;
+        std::vector<Tracer::Event> copied;
+        for (uint64_t i = first; i < head; i++)
+            copied.push_back(r->events[i % Tracer::Ring::capacity]);
+        // Events before oldest may have been overwritten while they were copied.
+        const uint64_t now = r->head.load(std::memory_order_acquire);
+        const uint64_t oldest =
+            now >= Tracer::Ring::capacity ? now - Tracer::Ring::capacity + 1 : 0;
+        if (oldest > first)
+            copied.erase(copied.begin(),
+                         copied.begin() + std::min<uint64_t>(copied.size(), oldest - first));
+
+        f << (count ? "," : "") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+          << ",\"tid\":" << r->tid << ",\"args\":{\"name\":" << jsonString(r->thread_name)
+          << "}}\n";
+        count++;
+        for (const auto &e : copied) {
+            if (e.begin_ns < start_ns || e.end_ns > stop_ns) continue;
+            f << ",{\"name\":" << jsonString(e.name) << ",\"ph\":\"X\",\"pid\":" << pid
+              << ",\"tid\":" << r->tid << ",\"ts\":" << (e.begin_ns - start_ns) / 1e3
+              << ",\"dur\":" << (e.end_ns - e.begin_ns) / 1e3 << "}\n";
+            count++;
+        }
+    }
+    f << "]}\n";
+    LOG(INFO) << "Wrote " << count << " trace events to " << path;
+}
+
+void Tracer::stop(const std::string &path) {
+    if (!recording_.exchange(false)) return;
+    const int64_t stop_ns = monotonicNs();
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings = rings_;
+        rings.insert(rings.end(), retired_.begin(), retired_.end());
+    }
+    writing_ = std::async(std::launch::async, [rings, start_ns = start_ns_, stop_ns, path] {
+        writeTrace(rings, start_ns, stop_ns, path);
+    });
+}
@@ -0,0 +1,74 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "timestamp.h"
+
+// A timeline of what each thread is doing, to see how the pipeline's stages overlap and where
+// threads idle or stall. Spans are recorded only between start() and stop(), into a ring
+// buffer per thread; stop() writes them in the Chrome trace event format (for chrome://tracing
+// or ui.perfetto.dev) on a thread of its own. Only a thread's first span takes a lock, to get
+// a ring, which is allocated only if no ring of an exited thread can be reused. Threads that
+// record should therefore be long-lived, short-lived ones would show up as a thread each.
+class Tracer {
+   public:
+    struct Event {
+        const char *name;  // a string literal
+        int64_t begin_ns, end_ns;
+    };
+    struct Ring;
+
+   private:
+    std::atomic<bool> recording_{false};
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<Ring>> rings_;  // of the live threads that recorded spans
+    std::vector<std::shared_ptr<Ring>> retired_;  // of threads that exited since start()
+    std::vector<std::shared_ptr<Ring>> free_;     // of threads that exited before start()
+    int64_t start_ns_ = 0;
+    std::future<void> writing_;
+
+    Tracer() = default;
+    Ring &ring();
+
+   public:
+    static Tracer &get();
+
+    bool recording() const { return recording_.load(std::memory_order_relaxed); }
+    // Ignored while recording or still writing the previous trace.
+    void start();
+    // Writes the spans since start() to path in the background.
+    void stop(const std::string &path);
+
+    void record(const char *name, int64_t begin_ns, int64_t end_ns);
+
+    // For thread_local cleanup only.
+    void removeRing(const Ring *ring);
+};
+
+// Names the calling thread, for the traces and e.g. top -H. Linux cuts names to 15 characters.
+void setThreadName(const std::string &name);
+
+// Records the scope it lives in as a span named name, which must be a string literal. Costs a
+// relaxed load while not recording.
+class TraceSpan {
+    const char *name_;
+    int64_t begin_ns_;
+
+   public:
+    explicit TraceSpan(const char *name)
+        : name_(name), begin_ns_(Tracer::get().recording() ? monotonicNs() : 0) {}
+    ~TraceSpan() {
+        if (begin_ns_) Tracer::get().record(name_, begin_ns_, monotonicNs());
+    }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+};
+
+#endif  // TRACE_H
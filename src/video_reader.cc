@@ -0,0 +1,272 @@
+#include "video_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <climits>
+
+#include "color_convert.h"
+#include "event_log.h"
+#include "glog/logging.h"
+#include "pixel_format.h"
+#include "timestamp.h"
+#include "trace.h"
+
+#ifdef WITH_JPEG
+#include <setjmp.h>
+#include <stdio.h>  // jpeglib.h needs FILE
+
+#include <jpeglib.h>
+#endif
+
+static constexpr int num_buffers = 4;
+
+static int openDevice(const char *device_name) {
+    int fd = open(device_name, O_RDWR);
+    PCHECK(fd >= 0) << "Can't open " << device_name;
+    return fd;
+}
+
+static int xioctl(int fd, unsigned long request, void *arg) {
+    int ret;
+    do ret = ioctl(fd, request, arg);
+    while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
+#ifdef WITH_JPEG
+struct JpegError {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+// Many webcams' MJPEG is slightly corrupt in every frame. libjpeg prints a warning to stderr
+// for each, count them in the event log instead. Trace messages (msg_level >= 0) are dropped.
+static void emitJpegMessage(j_common_ptr cinfo, int msg_level) {
+    if (msg_level >= 0) return;
+    cinfo->err->num_warnings++;
+    EventLog::get().record("capture_decode_warning");
+    if (VLOG_IS_ON(2)) {
+        char message[JMSG_LENGTH_MAX];
+        (*cinfo->err->format_message)(cinfo, message);
+        VLOG(2) << "Decode warning: " << message;
+    }
+}
+
+// Decodes a jpeg to rgb at 1/scale_denom of its size. Many webcams leave out the huffman
+// tables of their MJPEG frames, libjpeg-turbo fills in the standard ones.
+static bool decodeJpeg(const unsigned char *data, size_t size, int scale_denom, cv::Mat &rgb) {
+    struct jpeg_decompress_struct cinfo;
+    JpegError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = [](j_common_ptr cinfo) {
+        longjmp(reinterpret_cast<JpegError *>(cinfo->err)->jump, 1);
+    };
+    err.mgr.emit_message = emitJpegMessage;
+    if (setjmp(err.jump)) {
+        char message[JMSG_LENGTH_MAX];
+        (*cinfo.err->format_message)(reinterpret_cast<j_common_ptr>(&cinfo), message);
+        EventLog::get().record("capture_decode_failed");
+        VLOG(1) << "Can't decode frame: " << message;
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char *>(data), size);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale_denom;
+    jpeg_start_decompress(&cinfo);
+    rgb.create(cinfo.output_height, cinfo.output_width, CV_8UC3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = rgb.ptr<unsigned char>(cinfo.output_scanline);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+#endif
+
+VideoReader::VideoReader(const char *device_name, cv::Size size, uint32_t pixelformat)
+    : fd_(openDevice(device_name)) {
+#ifndef WITH_JPEG
+    CHECK(pixelformat != V4L2_PIX_FMT_MJPEG) << "Built without libjpeg, MJPEG is not available";
+#endif
+
+    struct v4l2_capability cap;
+    PCHECK(xioctl(fd_, VIDIOC_QUERYCAP, &cap) != -1);
+    CHECK(cap.device_caps & V4L2_CAP_VIDEO_CAPTURE) << device_name << " can't capture";
+    CHECK(cap.device_caps & V4L2_CAP_STREAMING) << device_name << " can't stream";
+
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = size.width;
+    fmt.fmt.pix.height = size.height;
+    fmt.fmt.pix.pixelformat = pixelformat;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    PCHECK(xioctl(fd_, VIDIOC_S_FMT, &fmt) != -1) << "Can't set capture format";
+    CHECK_EQ(fmt.fmt.pix.pixelformat, pixelformat) << device_name << " doesn't support the format";
+    pixelformat_ = fmt.fmt.pix.pixelformat;
+    size_ = cv::Size(fmt.fmt.pix.width, fmt.fmt.pix.height);
+    bytes_per_line_ = fmt.fmt.pix.bytesperline;
+    LOG(INFO) << "Capturing " << size_.width << "x" << size_.height << " from " << device_name;
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = num_buffers;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    PCHECK(xioctl(fd_, VIDIOC_REQBUFS, &req) != -1) << "Can't request buffers";
+    CHECK_GT(req.count, 0);
+
+    for (unsigned i = 0; i < req.count; i++) {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        PCHECK(xioctl(fd_, VIDIOC_QUERYBUF, &buf) != -1);
+        void *start = mmap(nullptr, buf.length, PROT_READ, MAP_SHARED, fd_, buf.m.offset);
+        PCHECK(start != MAP_FAILED);
+        buffers_.push_back({start, buf.length});
+        PCHECK(xioctl(fd_, VIDIOC_QBUF, &buf) != -1);
+    }
+
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    PCHECK(xioctl(fd_, VIDIOC_STREAMON, &type) != -1) << "Can't start streaming";
+
+    thread_ = std::thread(&VideoReader::run, this);
+}
+
+VideoReader::~VideoReader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(fd_, VIDIOC_STREAMOFF, &type);
+    for (const Buffer &b : buffers_) munmap(b.start, b.length);
+    close(fd_);
+}
+
+void VideoReader::run() {
+    setThreadName("decode");
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (1) {
+        cv_.wait(lock, [this] { return stopping_ || job_; });
+        if (stopping_) return;
+        lock.unlock();
+        bool ok = job_();
+        lock.lock();
+        job_ = nullptr;
+        job_ok_ = ok;
+        job_done_ = true;
+        cv_.notify_all();
+    }
+}
+
+void VideoReader::startJob(std::function<bool()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        job_ = std::move(job);
+        job_done_ = false;
+    }
+    cv_.notify_all();
+}
+
+bool VideoReader::finishJob() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return job_done_; });
+    return job_ok_;
+}
+
+bool VideoReader::convert(const unsigned char *data, size_t size, cv::Mat &frame, cv::Mat &small,
+                          cv::Size model_size) {
+    // The largest factor the format can downscale by that still covers model_size.
+    const int max_factor = pixelformat_ == V4L2_PIX_FMT_MJPEG ? 8 : INT_MAX;
+    int factor = 1;
+    if (!model_size.empty())
+        while (factor * 2 <= max_factor && size_.width / (factor * 2) >= model_size.width &&
+               size_.height / (factor * 2) >= model_size.height)
+            factor *= 2;
+
+#ifdef WITH_JPEG
+    if (pixelformat_ == V4L2_PIX_FMT_MJPEG) {
+        if (factor > 1)
+            startJob([&] {
+                TraceSpan span("decode_small");
+                return decodeJpeg(data, size, factor, small);
+            });
+        TraceSpan span("decode");
+        bool ok = decodeJpeg(data, size, 1, frame);
+        if (factor > 1) ok = finishJob() && ok;
+        if (factor == 1 && !model_size.empty()) small = frame;
+        return ok;
+    }
+#endif
+
+    cv::Mat raw;
+    size_t frame_size;
+    if (isPlanar(pixelformat_)) {
+        CHECK_EQ(bytes_per_line_, size_.width);
+        frame_size = (size_t)size_.area() * 3 / 2;
+        raw = cv::Mat(size_.height * 3 / 2, size_.width, CV_8U, const_cast<unsigned char *>(data));
+    } else {
+        frame_size = (size_t)bytes_per_line_ * size_.height;
+        raw = cv::Mat(size_, CV_8UC(bytesPerPixel(pixelformat_)),
+                      const_cast<unsigned char *>(data), bytes_per_line_);
+    }
+    if (size < frame_size) {
+        EventLog::get().record("capture_short_frame");
+        return false;
+    }
+
+    if (factor > 1)
+        startJob([&] {
+            TraceSpan span("convert_small");
+            convertToRgb(raw, size_, pixelformat_, small, factor);
+            return true;
+        });
+    TraceSpan span("convert");
+    convertToRgb(raw, size_, pixelformat_, frame);
+    if (factor > 1) finishJob();
+    if (factor == 1 && !model_size.empty()) small = frame;
+    return true;
+}
+
+bool VideoReader::read(cv::Mat &frame, cv::Mat &small, int64_t &timestamp_ns,
+                       cv::Size model_size) {
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    {
+        TraceSpan span("dequeue");
+        PCHECK(xioctl(fd_, VIDIOC_DQBUF, &buf) != -1) << "Can't dequeue a frame";
+    }
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        timestamp_ns = buf.timestamp.tv_sec * 1000000000LL + buf.timestamp.tv_usec * 1000LL;
+    else
+        timestamp_ns = monotonicNs();
+
+    bool ok = !(buf.flags & V4L2_BUF_FLAG_ERROR);
+    if (ok)
+        ok = convert(static_cast<const unsigned char *>(buffers_[buf.index].start), buf.bytesused,
+                     frame, small, model_size);
+    else
+        EventLog::get().record("capture_corrupt_frame");
+
+    PCHECK(xioctl(fd_, VIDIOC_QBUF, &buf) != -1) << "Can't requeue a buffer";
+    return ok;
+}
@@ -0,0 +1,65 @@
+#ifndef VIDEO_READER_H
+#define VIDEO_READER_H
+
+#include <linux/videodev2.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <thread>
+#include <vector>
+
+// Captures from a v4l2 device with mmap streaming I/O, in a pixel format of our choosing
+// rather than whatever OpenCV picks. MJPEG frames are decoded with libjpeg, which can decode
+// at 1/2, 1/4 or 1/8 scale almost for free, so the model's input is decoded separately at
+// the smallest scale still covering it instead of being resized from the full frame. The two
+// decodes run in parallel, the small one on a thread of the reader's own; libjpeg has no way
+// to share the entropy decoding between them.
+// Uncompressed formats go through convertToRgb, which downscales in the same pass.
+class VideoReader {
+    struct Buffer {
+        void *start;
+        size_t length;
+    };
+
+    const int fd_;
+    uint32_t pixelformat_;
+    cv::Size size_;
+    int bytes_per_line_;
+    std::vector<Buffer> buffers_;
+
+    // Produces the model's input while the calling thread does the full frame.
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::function<bool()> job_;  // empty if there is none
+    bool job_done_ = false, job_ok_ = false;
+    bool stopping_ = false;
+
+    void run();
+    void startJob(std::function<bool()> job);
+    bool finishJob();
+    bool convert(const unsigned char *data, size_t size, cv::Mat &frame, cv::Mat &small,
+                 cv::Size model_size);
+
+   public:
+    // Asks for size; the driver may pick another, see size(). Formats other than MJPEG must be
+    // supported by convertToRgb.
+    VideoReader(const char *device_name, cv::Size size, uint32_t pixelformat);
+    ~VideoReader();
+    VideoReader(const VideoReader &) = delete;
+    VideoReader &operator=(const VideoReader &) = delete;
+
+    cv::Size size() const { return size_; }
+
+    // Waits for the next frame and stores it in frame as rgb. If model_size isn't empty, small
+    // is set to an rgb copy downscaled by an integer factor but still at least model_size, or
+    // to frame if there is no such factor. Both are written in place, so pass fresh Mats while
+    // earlier frames are in use. timestamp_ns is set to the driver's timestamp of the frame if
+    // it is monotonic, to the time it was dequeued otherwise. Returns false if the frame is
+    // corrupt or short and has to be skipped.
+    bool read(cv::Mat &frame, cv::Mat &small, int64_t &timestamp_ns,
+              cv::Size model_size = cv::Size());
+};
+#endif  // VIDEO_READER_H
@@ -13,6 +13,7 @@
 #include <ostream>
 
 #include "glog/logging.h"
+#include "pixel_format.h"
 
 static std::ostream& operator<<(std::ostream& os, const struct v4l2_capability& cap) {
     std::ios_base::fmtflags f(os.flags());
@@ -52,29 +53,16 @@ static std::ostream& operator<<(std::ostream& os, const struct v4l2_format& fmt)
     return os;
 }
 
-constexpr int bytesPerPixel(int format) {
-    switch (format) {
-        case V4L2_PIX_FMT_YUYV:
-            return 2;
-        case V4L2_PIX_FMT_RGB24:
-        case V4L2_PIX_FMT_BGR24:
-            return 3;
-        case V4L2_PIX_FMT_RGB32:
-        case V4L2_PIX_FMT_BGR32:
-            return 4;
-        default:
-            CHECK(0) << "Unknown format " << format;
-            return -1;
-    }
+static int openDevice(const char* device_name) {
+    int fd = open(device_name, O_WRONLY);
+    PCHECK(fd >= 0) << "Can't open " << device_name;
+    return fd;
 }
 
-VideoWriter::VideoWriter(const char* device_name, int width, int height, int pixelformat)
-    : width_(width),
-      height_(height),
-      fd_(open(device_name, O_WRONLY)),
-      bpp_(bytesPerPixel(pixelformat)) {
-    CHECK(bpp_ > 0) << "Can't determine bytes per pixel for format " << pixelformat;
-    PCHECK(fd_ >= 0) << "Can't open " << device_name;
+VideoWriter::VideoWriter(const char* device_name, int width, int height, int pixelformat,
+                         DropPolicy policy)
+    : FdSink(openDevice(device_name), width, height, pixelformat, policy, true) {
+    const int bpp = bytesPerPixel(pixelformat);
 
     struct v4l2_capability cap;
     PCHECK(ioctl(fd_, VIDIOC_QUERYCAP, &cap) != -1);
@@ -100,21 +88,6 @@ VideoWriter::VideoWriter(const char* device_name, int width, int height, int pix
     fmt.fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
     PCHECK(ioctl(fd_, VIDIOC_S_FMT, &fmt) != 1) << "Can't set video format " << fmt;
     LOG(INFO) << "Set video format: " << fmt;
-    CHECK_EQ(fmt.fmt.pix.bytesperline, bpp_ * width);
-    CHECK_EQ(fmt.fmt.pix.sizeimage, bpp_ * width * height);
-}
-
-void VideoWriter::writeFrame(const cv::Mat& frame) {
-    CHECK(frame.isContinuous());
-    CHECK_EQ(frame.cols, width_);
-    CHECK_EQ(frame.rows, height_);
-    CHECK_EQ(frame.elemSize(), bpp_);
-    int total = width_ * height_ * bpp_;
-    int ret = write(fd_, frame.data, total);
-    PCHECK(ret > 0) << "Can't write " << total << " bytes to v4l loopback";
-
-    if (ret < total)
-        LOG(WARNING) << "write() truncated (wrote " << ret << ", want " << total << " bytes)";
-    else
-        LOG(INFO) << "Wrote a " << total << " bytes frame";
+    CHECK_EQ(fmt.fmt.pix.bytesperline, bpp * width);
+    CHECK_EQ(fmt.fmt.pix.sizeimage, bpp * width * height);
 }
@@ -3,13 +3,12 @@
 
 #include <linux/videodev2.h>
 
-#include <opencv2/core.hpp>
-
-class VideoWriter {
-    const int fd_, width_, height_, bpp_;
+#include "fd_sink.h"
 
+// Output to a v4l2loopback device.
+class VideoWriter : public FdSink {
    public:
-    VideoWriter(const char* device_name, int width, int height, int pixelformat);
-    void writeFrame(const cv::Mat& frame);
+    VideoWriter(const char* device_name, int width, int height, int pixelformat,
+                DropPolicy policy = DropPolicy::Block);
 };
 #endif  // VIDEO_WRITER_H